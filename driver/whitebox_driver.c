@@ -13,6 +13,8 @@
 #include <linux/seq_file.h>
 #include <linux/poll.h>
 #include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
 
 #include "pdma.h"
 #include "whitebox.h"
@@ -41,6 +43,12 @@ module_param(whitebox_debug, int, S_IRUSR | S_IWUSR);
 int whitebox_check_plls = 1;
 module_param(whitebox_check_plls, int, S_IRUSR | S_IWUSR);
 
+/*
+ * How often W_WAIT_LOCKED looks at lock detect, in microseconds.
+ */
+int whitebox_lock_poll_us = 10;
+module_param(whitebox_lock_poll_us, int, S_IRUSR | S_IWUSR);
+
 /*
  * Does an overrun or underrun cause a file error?
  */
@@ -129,6 +137,17 @@ module_param(whitebox_flow_control, int, S_IRUSR | S_IWUSR);
 int whitebox_frame_size = 1024;
 module_param(whitebox_frame_size, int, S_IRUSR | S_IWUSR);
 
+/*
+ * The parameters W_PARAM_GET and W_PARAM_SET reach, by WP_* id.
+ */
+static int *whitebox_params[WP_COUNT] = {
+    [WP_USER_ORDER] = &whitebox_user_order,
+    [WP_USER_SOURCE_BUFFER_THRESHOLD] = &whitebox_user_source_buffer_threshold,
+    [WP_USER_SINK_BUFFER_THRESHOLD] = &whitebox_user_sink_buffer_threshold,
+    [WP_FLOW_CONTROL] = &whitebox_flow_control,
+    [WP_FRAME_SIZE] = &whitebox_frame_size,
+};
+
 /*
  * Register mappings for the CMX991 register file.
  */
@@ -720,6 +739,38 @@ long whitebox_ioctl_locked(void) {
     return locked;
 }
 
+/*
+ * Sleeps on an hrtimer between looks at lock detect, rather than leaving
+ * userspace to spin on W_LOCKED.  Neither lock detect line raises an
+ * interrupt.
+ */
+long whitebox_ioctl_wait_locked(unsigned long arg) {
+    whitebox_lock_wait_t l;
+    ktime_t start, poll;
+    long locked;
+    if (copy_from_user(&l, (whitebox_lock_wait_t*)arg,
+            sizeof(whitebox_lock_wait_t)))
+        return -EACCES;
+
+    start = ktime_get();
+    poll = ktime_set(0, max(whitebox_lock_poll_us, 1) * NSEC_PER_USEC);
+    for (;;) {
+        locked = whitebox_ioctl_locked();
+        l.elapsed_us = ktime_us_delta(ktime_get(), start);
+        if (locked || l.elapsed_us >= l.timeout_us || signal_pending(current))
+            break;
+        set_current_state(TASK_INTERRUPTIBLE);
+        schedule_hrtimeout(&poll, HRTIMER_MODE_REL);
+    }
+
+    if (copy_to_user((whitebox_lock_wait_t*)arg, &l,
+            sizeof(whitebox_lock_wait_t)))
+        return -EACCES;
+    if (locked)
+        return 1;
+    return signal_pending(current) ? -EINTR : -ETIMEDOUT;
+}
+
 long whitebox_ioctl_exciter_clear(void) {
     struct whitebox_exciter *exciter = whitebox_device->rf_sink.exciter;
     pdma_clear(whitebox_device->platform_data->tx_dma_ch);
@@ -876,15 +927,21 @@ long whitebox_ioctl_adf4351_get(unsigned long arg) {
 long whitebox_ioctl_adf4351_set(unsigned long arg) {
     whitebox_args_t w;
     int i;
+    int changed = 0;
     if (copy_from_user(&w, (whitebox_args_t*)arg,
             sizeof(whitebox_args_t)))
         return -EACCES;
 
+    // Only the registers that changed are shifted out, R0 last.  The
+    // double buffered settings in R1, R2 and R4 only take effect on a
+    // write to R0, so R0 goes out whenever anything else did.
     for (i = WA_REGS_COUNT - 1; i >= 0; --i) {
-        if (whitebox_device->adf4351_regs[i] != w.flags.adf4351[i]) {
+        if (whitebox_device->adf4351_regs[i] != w.flags.adf4351[i]
+                || (i == 0 && changed)) {
             whitebox_device->adf4351_regs[i] = w.flags.adf4351[i];
             whitebox_gpio_adf4351_write(whitebox_device->platform_data, 
                     w.flags.adf4351[i]);
+            changed = 1;
         }
     }
 
@@ -934,6 +991,11 @@ long whitebox_ioctl_mmap_write(unsigned long arg)
     return count;
 }
 
+long whitebox_ioctl_tx_fill(void)
+{
+    return whitebox_user_source_data_total(&whitebox_device->user_source);
+}
+
 long whitebox_ioctl_mmap_read(unsigned long arg)
 {
     long count;
@@ -1008,12 +1070,90 @@ long whitebox_ioctl_fir_set(unsigned long arg) {
     return 0;
 }
 
+long whitebox_ioctl_param_get(unsigned long arg) {
+    whitebox_param_t p;
+    if (copy_from_user(&p, (whitebox_param_t*)arg,
+            sizeof(whitebox_param_t)))
+        return -EACCES;
+    if (p.id >= WP_COUNT)
+        return -EINVAL;
+    p.value = *whitebox_params[p.id];
+    if (copy_to_user((whitebox_param_t*)arg, &p,
+            sizeof(whitebox_param_t)))
+        return -EACCES;
+    return 0;
+}
+
+long whitebox_ioctl_param_set(unsigned long arg) {
+    whitebox_param_t p;
+    if (copy_from_user(&p, (whitebox_param_t*)arg,
+            sizeof(whitebox_param_t)))
+        return -EACCES;
+    if (p.id >= WP_COUNT)
+        return -EINVAL;
+    // ERANGE rather than EINVAL, which is what a driver without this ioctl
+    // says, so the library doesn't take a bad value for a missing ioctl.
+    if (p.value < 0 || (p.id == WP_FRAME_SIZE && p.value == 0))
+        return -ERANGE;
+    *whitebox_params[p.id] = p.value;
+    return 0;
+}
+
+long whitebox_ioctl_commit(unsigned long arg) {
+    struct whitebox_exciter *exciter = whitebox_device->rf_sink.exciter;
+    struct whitebox_receiver *receiver = whitebox_device->rf_source.receiver;
+    whitebox_commit_t c;
+    int i;
+    if (copy_from_user(&c, (whitebox_commit_t*)arg,
+            sizeof(whitebox_commit_t)))
+        return -EACCES;
+    if ((c.dirty & WCD_FIR) && c.fir.n > WF_COEFF_COUNT)
+        return -EINVAL;
+
+    if (c.dirty & WCD_EXCITER_INTERP)
+        exciter->ops->set_interp(exciter, c.exciter.interp);
+    if (c.dirty & WCD_EXCITER_FCW)
+        exciter->ops->set_fcw(exciter, c.exciter.fcw);
+    if (c.dirty & WCD_EXCITER_THRESHOLD)
+        exciter->ops->set_threshold(exciter, c.exciter.threshold);
+    if (c.dirty & WCD_EXCITER_CORRECTION)
+        exciter->ops->set_correction(exciter, c.exciter.correction);
+    if (c.dirty & WCD_EXCITER_GAIN)
+        exciter->ops->set_gain(exciter, c.exciter.gain);
+    if (c.dirty & WCD_FIR) {
+        u32 fir = ((c.fir.bank & 0x3) << 7) | (c.fir.n & 0x7f);
+        exciter->ops->set_fir(exciter, fir | WF_ACCESS_COEFFS);
+        for (i = 0; i < c.fir.n; ++i)
+            exciter->ops->set_fir_coeff(exciter, i, c.fir.coeff[i]);
+    }
+
+    if (c.dirty & WCD_RECEIVER_DECIM)
+        receiver->ops->set_decim(receiver, c.receiver.decim);
+    if (c.dirty & WCD_RECEIVER_FCW)
+        receiver->ops->set_fcw(receiver, c.receiver.fcw);
+    if (c.dirty & WCD_RECEIVER_THRESHOLD)
+        receiver->ops->set_threshold(receiver, c.receiver.threshold);
+    if (c.dirty & WCD_RECEIVER_CORRECTION)
+        receiver->ops->set_correction(receiver, c.receiver.correction);
+
+    // Enable last, once everything it depends on is in place.
+    if (c.dirty & WCD_EXCITER_STATE)
+        exciter->ops->set_state(exciter,
+                exciter->ops->get_state(exciter) | c.exciter.state);
+    if (c.dirty & WCD_RECEIVER_STATE)
+        receiver->ops->set_state(receiver,
+                receiver->ops->get_state(receiver) | c.receiver.state);
+    return 0;
+}
+
 static long whitebox_ioctl(struct file* filp, unsigned int cmd, unsigned long arg) {
     switch(cmd) {
         case W_RESET:
             return whitebox_ioctl_reset();
         case W_LOCKED:
             return whitebox_ioctl_locked();
+        case W_WAIT_LOCKED:
+            return whitebox_ioctl_wait_locked(arg);
         case WE_CLEAR:
             return whitebox_ioctl_exciter_clear();
         case WE_GET:
@@ -1048,6 +1188,14 @@ static long whitebox_ioctl(struct file* filp, unsigned int cmd, unsigned long ar
             return whitebox_ioctl_mmap_write(arg);
         case W_MMAP_READ:
             return whitebox_ioctl_mmap_read(arg);
+        case W_TX_FILL:
+            return whitebox_ioctl_tx_fill();
+        case W_COMMIT:
+            return whitebox_ioctl_commit(arg);
+        case W_PARAM_GET:
+            return whitebox_ioctl_param_get(arg);
+        case W_PARAM_SET:
+            return whitebox_ioctl_param_set(arg);
         case WF_GET:
             return whitebox_ioctl_fir_get(arg);
         case WF_SET:
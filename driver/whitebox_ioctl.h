@@ -168,6 +168,76 @@ typedef struct whitebox_args {
 #define W_MMAP_WRITE _IOR('w', 14, unsigned long*)
 #define W_MMAP_READ  _IOR('w', 15, unsigned long*)
 
+/* Bytes queued in the transmit buffer, not yet taken by the exciter */
+#define W_TX_FILL _IO('w', 22)
+
+/* Writes just the exciter, receiver and FIR fields flagged in dirty, all
+ * in one call.  The state fields are flags to set, not a whole state. */
+typedef struct whitebox_commit {
+    uint32_t dirty;
+    struct {
+        uint32_t state;
+        uint32_t interp;
+        uint32_t fcw;
+        uint32_t threshold;
+        uint32_t correction;
+        uint32_t gain;
+    } exciter;
+    struct {
+        uint32_t state;
+        uint32_t decim;
+        uint32_t fcw;
+        uint32_t threshold;
+        uint32_t correction;
+    } receiver;
+    struct {
+        uint8_t bank;
+        uint8_t n;
+        int32_t coeff[WF_COEFF_COUNT];
+    } fir;
+} whitebox_commit_t;
+
+#define W_COMMIT _IOW('w', 23, whitebox_commit_t*)
+
+#define WCD_EXCITER_STATE       (1 << 0)
+#define WCD_EXCITER_INTERP      (1 << 1)
+#define WCD_EXCITER_FCW         (1 << 2)
+#define WCD_EXCITER_THRESHOLD   (1 << 3)
+#define WCD_EXCITER_CORRECTION  (1 << 4)
+#define WCD_EXCITER_GAIN        (1 << 5)
+#define WCD_RECEIVER_STATE      (1 << 8)
+#define WCD_RECEIVER_DECIM      (1 << 9)
+#define WCD_RECEIVER_FCW        (1 << 10)
+#define WCD_RECEIVER_THRESHOLD  (1 << 11)
+#define WCD_RECEIVER_CORRECTION (1 << 12)
+#define WCD_FIR                 (1 << 16)
+
+/* The tunables that are also under /sys/module/whitebox/parameters, read
+ * and written without a file and a string each time. */
+typedef struct whitebox_param {
+    uint32_t id;
+    int32_t value;
+} whitebox_param_t;
+
+#define W_PARAM_GET _IOWR('w', 24, whitebox_param_t*)
+#define W_PARAM_SET _IOW('w', 25, whitebox_param_t*)
+
+#define WP_USER_ORDER                   0
+#define WP_USER_SOURCE_BUFFER_THRESHOLD 1
+#define WP_USER_SINK_BUFFER_THRESHOLD   2
+#define WP_FLOW_CONTROL                 3
+#define WP_FRAME_SIZE                   4
+#define WP_COUNT                        5
+
+/* Waits up to timeout_us for both PLLs to lock.  Returns 1 once they have,
+ * or fails with ETIMEDOUT; either way elapsed_us is how long it took. */
+typedef struct whitebox_lock_wait {
+    uint32_t timeout_us;
+    uint32_t elapsed_us;
+} whitebox_lock_wait_t;
+
+#define W_WAIT_LOCKED _IOWR('w', 26, whitebox_lock_wait_t*)
+
 /* FIR Filter */
 #define WF_GET _IOR('w', 18, whitebox_args_t*)
 #define WF_SET _IOR('w', 19, whitebox_args_t*)
@@ -1,6 +1,11 @@
 #include "whitebox.h"
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 /*
 
@@ -77,10 +82,766 @@ uint32_t sincos16c(uint32_t fcw, uint32_t *phase) {
     return QUAD_PACK(ci, si);
 }
 
+#define DDS_ENTRY(phase) \
+    (((phase) >> DDS_PHASE_SHIFT) & (DDS_ROM_NUM_SAMPLES - 1))
+
+// The LUT already holds cos in the low half and sin in the high half of each
+// word, so a block of complex samples is one load per sample.
+void sincos16c_block(uint32_t fcw, uint32_t *phase, uint32_t *iq, int n) {
+    uint32_t p = *phase;
+    int i = 0;
+
+#if defined(__AVX2__)
+    if (n >= 8) {
+        const __m256i mask = _mm256_set1_epi32(DDS_PA_MAX - 1);
+        const __m256i entries = _mm256_set1_epi32(DDS_ROM_NUM_SAMPLES - 1);
+        const __m256i step = _mm256_set1_epi32(fcw << 3);
+        __m256i ph = _mm256_and_si256(_mm256_add_epi32(_mm256_set1_epi32(p),
+                _mm256_mullo_epi32(_mm256_set1_epi32(fcw),
+                _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7))), mask);
+        for (; i + 8 <= n; i += 8) {
+            __m256i idx = _mm256_and_si256(
+                    _mm256_srli_epi32(ph, DDS_PHASE_SHIFT), entries);
+            _mm256_storeu_si256((__m256i*)(iq + i), _mm256_i32gather_epi32(
+                    (const int*)sincos_lut_addr, idx, 4));
+            ph = _mm256_and_si256(_mm256_add_epi32(ph, step), mask);
+        }
+        p = (uint32_t)_mm256_extract_epi32(ph, 0);
+    }
+#endif
+
+    for (; i < n; ++i) {
+        iq[i] = sincos_lut_addr[DDS_ENTRY(p)];
+        p = (p + fcw) & (DDS_PA_MAX - 1);
+    }
+    *phase = p;
+}
+
+void cos16_block(uint32_t fcw, uint32_t *phase, int16_t *s, int n) {
+    uint32_t p = *phase;
+    int i = 0;
+
+#if defined(__AVX2__)
+    if (n >= 8) {
+        const __m256i mask = _mm256_set1_epi32(DDS_PA_MAX - 1);
+        const __m256i entries = _mm256_set1_epi32(DDS_ROM_NUM_SAMPLES - 1);
+        const __m256i step = _mm256_set1_epi32(fcw << 3);
+        __m256i ph = _mm256_and_si256(_mm256_add_epi32(_mm256_set1_epi32(p),
+                _mm256_mullo_epi32(_mm256_set1_epi32(fcw),
+                _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7))), mask);
+        for (; i + 8 <= n; i += 8) {
+            __m256i idx = _mm256_and_si256(
+                    _mm256_srli_epi32(ph, DDS_PHASE_SHIFT), entries);
+            __m256i v = _mm256_i32gather_epi32(
+                    (const int*)sincos_lut_addr, idx, 4);
+            // Sign extend the cos half, then narrow to eight int16.
+            v = _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+            v = _mm256_permute4x64_epi64(_mm256_packs_epi32(v, v), 0x08);
+            _mm_storeu_si128((__m128i*)(s + i), _mm256_castsi256_si128(v));
+            ph = _mm256_and_si256(_mm256_add_epi32(ph, step), mask);
+        }
+        p = (uint32_t)_mm256_extract_epi32(ph, 0);
+    }
+#endif
+
+    for (; i < n; ++i) {
+        s[i] = (int16_t)(sincos_lut_addr[DDS_ENTRY(p)] & 0xffffUL);
+        p = (p + fcw) & (DDS_PA_MAX - 1);
+    }
+    *phase = p;
+}
+
+// A full turn of the phase accumulator is DDS_PA_MAX.
 uint32_t freq_to_fcw(float freq, float sample_rate) {
-    return (uint32_t)(freq / (sample_rate / (DDS_PA_MAX >> 1)));
+    return (uint32_t)(freq / (sample_rate / DDS_PA_MAX));
+}
+
+static int gcd(int a, int b) {
+    while (b) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+int resampler_init(struct resampler *r, int in_rate, int out_rate) {
+    int g, p, k, len;
+    double fc, center;
+
+    if (in_rate <= 0 || out_rate <= 0)
+        return -1;
+
+    g = gcd(in_rate, out_rate);
+    r->l = out_rate / g;
+    r->m = in_rate / g;
+
+    // Decimating by more than one needs the prototype to span that many
+    // more input samples to keep the same transition band at the output.
+    r->taps = RESAMPLER_TAPS;
+    while (r->taps < RESAMPLER_MAX_TAPS && (long)r->taps * r->l < (long)RESAMPLER_TAPS * r->m)
+        r->taps <<= 1;
+    r->phases = RESAMPLER_MAX_COEFFS / r->taps - 1;
+    if (r->phases > RESAMPLER_MAX_PHASES)
+        r->phases = RESAMPLER_MAX_PHASES;
+    if (r->phases > r->l)
+        r->phases = r->l;
+
+    // Blackman windowed sinc prototype at phases times the input rate, cut
+    // off just below the lower of the two Nyquist frequencies.  There's one
+    // row past the last phase, the first row a sample later, to
+    // interpolate towards.
+    len = r->phases * r->taps;
+    center = len / 2.0;
+    fc = 0.45 * (r->l < r->m ? (double)r->l / r->m : 1.0) / r->phases;
+
+    for (p = 0; p <= r->phases; ++p) {
+        double row[RESAMPLER_MAX_TAPS];
+        double sum = 0;
+        for (k = 0; k < r->taps; ++k) {
+            int j = p + k * r->phases;
+            double t = j - center;
+            double w = 0.42 - 0.5 * cos(2 * M_PI * j / len)
+                    + 0.08 * cos(4 * M_PI * j / len);
+            row[k] = (t == 0 ? 2 * fc : sin(2 * M_PI * fc * t) / (M_PI * t)) * w;
+            sum += row[k];
+        }
+        // Each row gets unity DC gain; stored reversed so the newest
+        // sample lines up with the last coefficient.
+        for (k = 0; k < r->taps; ++k)
+            r->coeffs[p * r->taps + r->taps - 1 - k] =
+                (int16_t)floor(row[k] / sum * 32767 + 0.5);
+    }
+
+    resampler_reset(r);
+    return 0;
+}
+
+void resampler_reset(struct resampler *r) {
+    r->phase = r->l;
+    r->pos = 0;
+    memset(r->history, 0, sizeof(r->history));
+}
+
+static int32_t resampler_dot(const int16_t *h, const int16_t *x, int taps) {
+    int32_t acc = 0;
+    int k;
+    for (k = 0; k < taps; ++k)
+        acc += (int32_t)h[k] * x[k];
+    return acc;
+}
+
+static int16_t resampler_output(struct resampler *r) {
+    int32_t acc;
+    const int16_t *x = &r->history[r->pos];
+
+    if (r->l == r->phases) {
+        acc = resampler_dot(&r->coeffs[r->phase * r->taps], x, r->taps);
+    } else {
+        // Blend the two nearest rows, frac in Q15.
+        int64_t where = ((int64_t)r->phase * r->phases << 15) / r->l;
+        int row = (int)(where >> 15);
+        int32_t frac = (int32_t)(where & 0x7fff);
+        int32_t a = resampler_dot(&r->coeffs[row * r->taps], x, r->taps) >> 15;
+        int32_t b = resampler_dot(&r->coeffs[(row + 1) * r->taps], x, r->taps) >> 15;
+        acc = a * 32768 + (b - a) * frac;
+    }
+    acc = (acc + (1 << 14)) >> 15;
+    if (acc > 32767)
+        return 32767;
+    if (acc < -32768)
+        return -32768;
+    return (int16_t)acc;
+}
+
+int resample16(struct resampler *r, const int16_t *in, int in_count,
+        int16_t *out, int out_count, int *consumed) {
+    int produced = 0, used = 0;
+
+    while (1) {
+        while (r->phase < r->l && produced < out_count) {
+            out[produced++] = resampler_output(r);
+            r->phase += r->m;
+        }
+        if (produced == out_count || used == in_count)
+            break;
+        // The history is stored twice so the newest taps samples
+        // are always contiguous at history[pos].
+        r->phase -= r->l;
+        r->history[r->pos] = r->history[r->pos + r->taps] = in[used++];
+        r->pos = (r->pos + 1) & (r->taps - 1);
+    }
+
+    if (consumed)
+        *consumed = used;
+    return produced;
+}
+
+int resampler_input_needed(struct resampler *r, int out_count) {
+    int phase = r->phase, produced = 0, needed = 0;
+    while (1) {
+        while (phase < r->l && produced < out_count) {
+            produced++;
+            phase += r->m;
+        }
+        if (produced == out_count)
+            return needed;
+        phase -= r->l;
+        needed++;
+    }
+}
+
+static inline int16_t saturate16(int32_t v) {
+    if (v > 32767)
+        return 32767;
+    if (v < -32768)
+        return -32768;
+    return (int16_t)v;
+}
+
+int16_t atan2_16(int32_t y, int32_t x) {
+    uint32_t ax = x < 0 ? -x : x;
+    uint32_t ay = y < 0 ? -y : y;
+    uint32_t big = ax > ay ? ax : ay;
+    uint32_t r;
+    int32_t angle;
+
+    if (big == 0)
+        return 0;
+
+    // Keep the ratio's numerator within 31 bits.
+    if (big > 0xffff) {
+        int shift = 16 - __builtin_clz(big);
+        ax >>= shift;
+        ay >>= shift;
+        big >>= shift;
+    }
+
+    // First octant: atan(r) ~ pi/4 r + 0.273 r (1 - r), in units of pi.
+    r = ((ax > ay ? ay : ax) << 15) / big;
+    angle = (r >> 2) + ((2847 * ((r * (32768 - r)) >> 15)) >> 15);
+
+    if (ay > ax)
+        angle = 16384 - angle;
+    if (x < 0)
+        angle = 32768 - angle;
+    if (y < 0)
+        angle = -angle;
+    return (int16_t)angle;
+}
+
+void fm_modulator_init(struct fm_modulator *fm, int16_t sensitivity) {
+    // Phase step = audio * sensitivity * DDS_PA_MAX / (2 pi 2^30)
+    //            = (audio * gain) >> 7, with gain = 2 sensitivity / pi.
+    fm->gain = (int32_t)(sensitivity * 2 / M_PI + 0.5);
+    fm->phase = 0;
+    fm->last = 0;
+}
+
+void fm_mod_block(struct fm_modulator *fm, const int16_t *audio,
+        uint32_t *iq, int n) {
+    int k;
+    uint32_t phase = fm->phase;
+    int32_t last = fm->last;
+    for (k = 0; k < n; ++k) {
+        int32_t x = audio[k];
+        // Multiplies rather than shifts, since x may be negative.
+        int16_t pre = saturate16(
+                ((x * 32768 - FM_EMPHASIS_ALPHA * last) >> 15)
+                * (1 << FM_EMPHASIS_SHIFT));
+        last = x;
+        phase = (phase + ((pre * fm->gain) >> 7)) & (DDS_PA_MAX - 1);
+        iq[k] = sincos_lut_addr[DDS_ENTRY(phase)];
+    }
+    fm->phase = phase;
+    fm->last = (int16_t)last;
+}
+
+void fm_demodulator_init(struct fm_demodulator *fm, int16_t sensitivity) {
+    // Full deviation is a phase step of sensitivity / pi in atan2_16 units;
+    // scale that back up to full scale audio, Q8.
+    fm->gain = (int32_t)(32767. * 256. * M_PI / sensitivity + 0.5);
+    fm->last = 0;
+    fm->dc_in = 0;
+    fm->dc_out = 0;
+    fm->deemphasis = 0;
+}
+
+void fm_demod_block(struct fm_demodulator *fm, const uint32_t *iq,
+        int16_t *audio, int n) {
+    int k;
+    uint32_t last = fm->last;
+    int32_t dc_in = fm->dc_in, dc_out = fm->dc_out, de = fm->deemphasis;
+    for (k = 0; k < n; ++k) {
+        int16_t i, q, i1, q1;
+        int32_t re, im, d;
+        QUAD_UNPACK(iq[k], i, q);
+        QUAD_UNPACK(last, i1, q1);
+        last = iq[k];
+
+        // x[n] * conj(x[n-1]); halved so the sum cannot overflow.
+        re = ((int32_t)i * i1 >> 1) + ((int32_t)q * q1 >> 1);
+        im = ((int32_t)q * i1 >> 1) - ((int32_t)i * q1 >> 1);
+        d = (atan2_16(im, re) * fm->gain) >> 8;
+
+        // Remove the offset of a mistuned carrier before the de-emphasis
+        // integrator can amplify it.  Both filters keep 6 fractional bits
+        // of state so truncation does not build up an offset of its own.
+        dc_out = (d - dc_in) * 64 +
+            (int32_t)(((int64_t)FM_DC_BLOCK_BETA * dc_out) >> 15);
+        dc_in = d;
+
+        // Inverse of the pre-emphasis.
+        de = (dc_out >> FM_EMPHASIS_SHIFT) +
+            (int32_t)(((int64_t)FM_EMPHASIS_ALPHA * de) >> 15);
+        audio[k] = saturate16(de >> 6);
+    }
+    fm->last = last;
+    fm->dc_in = dc_in;
+    fm->dc_out = dc_out;
+    fm->deemphasis = de;
+}
+
+void hilbert_init(struct hilbert *h) {
+    int i;
+    for (i = 0; i < HILBERT_LINE / 2; ++i) {
+        // Oldest sample in the line sits at this (odd) offset from centre.
+        int m = HILBERT_DELAY - 2 * i;
+        int k = HILBERT_DELAY + m;
+        double w = 0.54 - 0.46 * cos(2. * M_PI * k / (HILBERT_TAPS - 1));
+        h->coeffs[i] = (int16_t)lround(2. / (M_PI * m) * w * (1 << 14));
+    }
+    h->parity = 0;
+    h->pos[0] = h->pos[1] = 0;
+    memset(h->line, 0, sizeof(h->line));
+}
+
+void hilbert_block(struct hilbert *h, const int16_t *in, int16_t *delayed,
+        int16_t *out, int n) {
+    int k, i;
+    for (k = 0; k < n; ++k) {
+        int p = h->parity;
+        int16_t *line = h->line[p];
+        const int16_t *w, *other;
+        int pos = h->pos[p];
+        int32_t acc = 0;
+
+        line[pos] = line[pos + HILBERT_LINE] = in[k];
+        if (++pos == HILBERT_LINE)
+            pos = 0;
+        h->pos[p] = pos;
+
+        // Taps of the same parity as the newest sample, oldest first.
+        w = line + pos;
+        for (i = 0; i < HILBERT_LINE / 2; ++i)
+            acc += h->coeffs[i] * ((int32_t)w[i] - w[HILBERT_LINE - 1 - i]);
+        out[k] = saturate16((acc + (1 << 13)) >> 14);
+
+        // The centre tap is in the other line.
+        other = h->line[p ^ 1] + h->pos[p ^ 1];
+        delayed[k] = other[HILBERT_LINE - 1 - HILBERT_DELAY / 2];
+        h->parity = p ^ 1;
+    }
 }
 
-void awgn(int16_t *s) {
-    *s = rand() % (1 << 16 - 1);
+#define SSB_CHUNK 64
+
+void ssb_modulator_init(struct ssb_modulator *ssb, int lsb) {
+    ssb->lsb = lsb;
+    hilbert_init(&ssb->hilbert);
+}
+
+void ssb_mod_block(struct ssb_modulator *ssb, const int16_t *audio,
+        uint32_t *iq, int n) {
+    int16_t i[SSB_CHUNK], q[SSB_CHUNK];
+    while (n > 0) {
+        int k, count = n < SSB_CHUNK ? n : SSB_CHUNK;
+        hilbert_block(&ssb->hilbert, audio, i, q, count);
+        if (ssb->lsb) {
+            for (k = 0; k < count; ++k)
+                iq[k] = QUAD_PACK(i[k], saturate16(-q[k]));
+        } else {
+            for (k = 0; k < count; ++k)
+                iq[k] = QUAD_PACK(i[k], q[k]);
+        }
+        audio += count;
+        iq += count;
+        n -= count;
+    }
+}
+
+void ssb_demodulator_init(struct ssb_demodulator *ssb, int lsb) {
+    ssb->lsb = lsb;
+    ssb->pos = 0;
+    memset(ssb->delay, 0, sizeof(ssb->delay));
+    hilbert_init(&ssb->hilbert);
+}
+
+void ssb_demod_block(struct ssb_demodulator *ssb, const uint32_t *iq,
+        int16_t *audio, int n) {
+    int16_t i[SSB_CHUNK], q[SSB_CHUNK], qd[SSB_CHUNK], hq[SSB_CHUNK];
+    while (n > 0) {
+        int k, count = n < SSB_CHUNK ? n : SSB_CHUNK;
+        for (k = 0; k < count; ++k) {
+            int16_t d;
+            QUAD_UNPACK(iq[k], i[k], q[k]);
+            d = ssb->delay[ssb->pos];
+            ssb->delay[ssb->pos] = i[k];
+            i[k] = d;
+            if (++ssb->pos == HILBERT_DELAY)
+                ssb->pos = 0;
+        }
+        hilbert_block(&ssb->hilbert, q, qd, hq, count);
+        // H{H{x}} = -x, so the wanted sideband adds and the other cancels.
+        if (ssb->lsb) {
+            for (k = 0; k < count; ++k)
+                audio[k] = (int16_t)(((int32_t)i[k] + hq[k]) >> 1);
+        } else {
+            for (k = 0; k < count; ++k)
+                audio[k] = (int16_t)(((int32_t)i[k] - hq[k]) >> 1);
+        }
+        iq += count;
+        audio += count;
+        n -= count;
+    }
+}
+
+void mixer_set_frequency(struct mixer *m, float freq, float sample_rate) {
+    if (freq < 0)
+        m->fcw = (DDS_PA_MAX - freq_to_fcw(-freq, sample_rate)) &
+            (DDS_PA_MAX - 1);
+    else
+        m->fcw = freq_to_fcw(freq, sample_rate);
+}
+
+#define MIXER_CHUNK 64
+
+void mixer_block(struct mixer *m, const uint32_t *in, uint32_t *out, int n) {
+    uint32_t nco[MIXER_CHUNK];
+    if (m->fcw == 0) {
+        if (in != out)
+            memcpy(out, in, n * sizeof(uint32_t));
+        return;
+    }
+    while (n > 0) {
+        int k, count = n < MIXER_CHUNK ? n : MIXER_CHUNK;
+        sincos16c_block(m->fcw, &m->phase, nco, count);
+        for (k = 0; k < count; ++k) {
+            int16_t a, b, c, s;
+            int32_t i, q;
+            QUAD_UNPACK(in[k], a, b);
+            QUAD_UNPACK(nco[k], c, s);
+            // Products are halved so full scale inputs cannot overflow.
+            i = (((int32_t)a * c >> 1) - ((int32_t)b * s >> 1) + (1 << 13)) >> 14;
+            q = (((int32_t)a * s >> 1) + ((int32_t)b * c >> 1) + (1 << 13)) >> 14;
+            out[k] = QUAD_PACK(saturate16(i), saturate16(q));
+        }
+        in += count;
+        out += count;
+        n -= count;
+    }
+}
+
+// Largest component that keeps every magnitude below 2^14, so that a
+// butterfly's output magnitude, at most twice its input, still fits.
+#define FFT_HEADROOM 11584
+
+static int fft_stage_shift(const uint32_t *x, int n) {
+    int k, shift = 0;
+    int32_t peak = 0;
+    for (k = 0; k < n; ++k) {
+        int16_t i, q;
+        int32_t a, b;
+        QUAD_UNPACK(x[k], i, q);
+        a = i < 0 ? -i : i;
+        b = q < 0 ? -q : q;
+        if (a > peak)
+            peak = a;
+        if (b > peak)
+            peak = b;
+    }
+    while ((peak >> shift) > FFT_HEADROOM)
+        ++shift;
+    return shift;
+}
+
+static void fft_bit_reverse(uint32_t *x, int order) {
+    int n = 1 << order;
+    int k, j = 0;
+    for (k = 0; k < n - 1; ++k) {
+        int bit;
+        if (k < j) {
+            uint32_t t = x[k];
+            x[k] = x[j];
+            x[j] = t;
+        }
+        for (bit = n >> 1; j & bit; bit >>= 1)
+            j ^= bit;
+        j |= bit;
+    }
+}
+
+// a' = a + b W, b' = a - b W, inputs shifted right first.  W is a LUT entry
+// (cos, sin) for a positive angle; the forward transform uses its conjugate.
+static inline void fft_butterfly(uint32_t *a, uint32_t *b, uint32_t w,
+        int shift) {
+    int16_t ar, ai, br, bi, c, s;
+    int32_t tr, ti;
+    QUAD_UNPACK(*a, ar, ai);
+    QUAD_UNPACK(*b, br, bi);
+    QUAD_UNPACK(w, c, s);
+    ar >>= shift;
+    ai >>= shift;
+    br >>= shift;
+    bi >>= shift;
+    tr = ((int32_t)br * c + (int32_t)bi * s + (1 << 14)) >> 15;
+    ti = ((int32_t)bi * c - (int32_t)br * s + (1 << 14)) >> 15;
+    *a = QUAD_PACK(ar + tr, ai + ti);
+    *b = QUAD_PACK(ar - tr, ai - ti);
+}
+
+#if defined(__AVX2__)
+// Eight butterflies at once, same arithmetic as fft_butterfly.
+static inline void fft_butterfly8(uint32_t *a, uint32_t *b, int j,
+        int stride, int shift) {
+    const __m256i swap = _mm256_setr_epi8(
+            2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+            2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i negate_low = _mm256_set1_epi32(0x0001ffff);
+    const __m256i round = _mm256_set1_epi32(1 << 14);
+    __m256i idx = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_set1_epi32(j),
+            _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)),
+            _mm256_set1_epi32(stride));
+    __m256i w = _mm256_i32gather_epi32((const int*)sincos_lut_addr, idx, 4);
+    __m256i va = _mm256_srai_epi16(_mm256_loadu_si256((__m256i*)a), shift);
+    __m256i vb = _mm256_srai_epi16(_mm256_loadu_si256((__m256i*)b), shift);
+    // (br, bi).(c, s) and (br, bi).(-s, c)
+    __m256i tr = _mm256_madd_epi16(vb, w);
+    __m256i ti = _mm256_madd_epi16(vb,
+            _mm256_sign_epi16(_mm256_shuffle_epi8(w, swap), negate_low));
+    __m256i t;
+    tr = _mm256_srai_epi32(_mm256_add_epi32(tr, round), 15);
+    ti = _mm256_srai_epi32(_mm256_add_epi32(ti, round), 15);
+    t = _mm256_blend_epi16(tr, _mm256_slli_epi32(ti, 16), 0xaa);
+    _mm256_storeu_si256((__m256i*)a, _mm256_add_epi16(va, t));
+    _mm256_storeu_si256((__m256i*)b, _mm256_sub_epi16(va, t));
+}
+#endif
+
+static int fft_stages(uint32_t *x, int order) {
+    int n = 1 << order;
+    int exponent = 0;
+    int half;
+    for (half = 1; half < n; half <<= 1) {
+        // Twiddle j of this stage is e^(-i pi j / half).
+        int stride = DDS_ROM_NUM_SAMPLES / (half << 1);
+        int shift = fft_stage_shift(x, n);
+        int group, j;
+        exponent += shift;
+        for (group = 0; group < n; group += half << 1) {
+            uint32_t *a = x + group, *b = a + half;
+            j = 0;
+#if defined(__AVX2__)
+            for (; j + 8 <= half; j += 8)
+                fft_butterfly8(a + j, b + j, j, stride, shift);
+#endif
+            for (; j < half; ++j)
+                fft_butterfly(a + j, b + j, sincos_lut_addr[j * stride],
+                        shift);
+        }
+    }
+    return exponent;
+}
+
+int fft16(uint32_t *x, int order) {
+    fft_bit_reverse(x, order);
+    return fft_stages(x, order);
+}
+
+int fft16_copy(const uint32_t *in, uint32_t *out, int order) {
+    memcpy(out, in, sizeof(uint32_t) << order);
+    return fft16(out, order);
+}
+
+// log2(1 + i / 256), Q8.
+static uint8_t log2_fraction[256];
+static int log2_fraction_ready = 0;
+
+// log2(v), Q8; 0 for v = 0.
+static inline int32_t log2_q8(uint32_t v) {
+    int msb;
+    uint32_t f;
+    if (v == 0)
+        return 0;
+    msb = 31 - __builtin_clz(v);
+    f = msb >= 8 ? v >> (msb - 8) : v << (8 - msb);
+    return (msb << 8) + log2_fraction[f & 0xff];
+}
+
+int spectrum_init(struct spectrum *s, int order) {
+    int i;
+    if (order < SPECTRUM_MIN_ORDER || order > FFT_MAX_ORDER)
+        return -1;
+    if (!log2_fraction_ready) {
+        for (i = 0; i < 256; ++i)
+            log2_fraction[i] = (uint8_t)lround(log2(1. + i / 256.) * 256.);
+        log2_fraction_ready = 1;
+    }
+    s->order = order;
+    s->fill = 0;
+    s->count = 0;
+    memset(s->sum, 0, sizeof(s->sum));
+    return 0;
+}
+
+static void spectrum_transform(struct spectrum *s) {
+    int n = 1 << s->order;
+    int stride = DDS_ROM_NUM_SAMPLES >> s->order;
+    int k, e;
+    // Power relative to a full scale tone, whose windowed peak is n 2^14.
+    int32_t reference = (s->order + 14) << 9;
+
+    for (k = 0; k < n; ++k) {
+        int16_t i, q, c, unused;
+        int32_t w;
+        QUAD_UNPACK(s->frame[k], i, q);
+        QUAD_UNPACK(sincos_lut_addr[k * stride], c, unused);
+        (void)unused;
+        w = (32767 - c) >> 1;
+        s->frame[k] = QUAD_PACK((i * w) >> 15, (q * w) >> 15);
+    }
+    e = fft16(s->frame, s->order);
+    for (k = 0; k < n; ++k) {
+        int16_t i, q;
+        QUAD_UNPACK(s->frame[k], i, q);
+        s->sum[k] += log2_q8((uint32_t)((int32_t)i * i) +
+                (uint32_t)((int32_t)q * q)) + (e << 9) - reference;
+    }
+    s->count++;
+}
+
+int spectrum_push(struct spectrum *s, const uint32_t *iq, int n) {
+    int space = (1 << s->order) - s->fill;
+    int used = n < space ? n : space;
+    memcpy(s->frame + s->fill, iq, used * sizeof(uint32_t));
+    s->fill += used;
+    if (s->fill == 1 << s->order) {
+        spectrum_transform(s);
+        s->fill = 0;
+    }
+    return used;
+}
+
+int spectrum_read(struct spectrum *s, uint8_t *bins) {
+    int n = 1 << s->order;
+    int k, count = s->count;
+    if (count == 0)
+        return 0;
+    for (k = 0; k < n; ++k) {
+        // Q8 log2 power to half dB steps: 20 log10(2) / 256.
+        int32_t v = 255 + (s->sum[(k + (n >> 1)) & (n - 1)] / count) *
+            1541 / 65536;
+        bins[k] = v < 0 ? 0 : v > 255 ? 255 : (uint8_t)v;
+        s->sum[(k + (n >> 1)) & (n - 1)] = 0;
+    }
+    s->count = 0;
+    return count;
+}
+
+uint64_t iq_energy(const uint32_t *iq, int count) {
+    uint64_t energy = 0;
+    int n;
+    // Each term is at most 2^31, so a pair of them fits a uint32_t.
+    for (n = 0; n < count; ++n) {
+        int16_t i, q;
+        QUAD_UNPACK(iq[n], i, q);
+        energy += (uint32_t)((int32_t)i * i) + (uint32_t)((int32_t)q * q);
+    }
+    return energy;
+}
+
+float iq_power_dbfs(uint64_t energy, unsigned long count) {
+    if (energy == 0 || count == 0)
+        return -HUGE_VAL;
+    return 10. * log10((double)energy / count / (32767. * 32767.));
+}
+
+// The uniform is 22 bits, leaving 10 for the angle.  Rows are its leading
+// zero count, columns the next NOISE_MANTISSA_BITS bits below the leading
+// one; entries are sqrt(-2 ln u) at the middle of the bin, Q12.
+#define NOISE_UNIFORM_BITS  22
+#define NOISE_MANTISSA_BITS 6
+
+static int16_t noise_radius[NOISE_UNIFORM_BITS][1 << NOISE_MANTISSA_BITS];
+static int noise_radius_ready = 0;
+
+static void noise_radius_init(void) {
+    int e, m;
+    for (e = 0; e < NOISE_UNIFORM_BITS; ++e) {
+        for (m = 0; m < (1 << NOISE_MANTISSA_BITS); ++m) {
+            double u = ldexp(1. + (m + .5) / (1 << NOISE_MANTISSA_BITS),
+                    -(e + 1));
+            noise_radius[e][m] = (int16_t)lround(sqrt(-2. * log(u)) * 4096.);
+        }
+    }
+    noise_radius_ready = 1;
+}
+
+void noise_init(struct noise *n, uint32_t seed, int16_t sigma) {
+    if (!noise_radius_ready)
+        noise_radius_init();
+    // xorshift32 must never be seeded with zero.
+    n->state = seed ? seed : 2463534242u;
+    n->sigma = sigma;
+}
+
+static inline uint32_t noise_pair(struct noise *n, uint32_t x) {
+    uint32_t u = x >> (32 - NOISE_UNIFORM_BITS);
+    int e = NOISE_UNIFORM_BITS - 1, m = 0;
+    int32_t r, c, s;
+    int16_t i, q;
+    if (u) {
+        e = __builtin_clz(u) - (32 - NOISE_UNIFORM_BITS);
+        m = ((u << e) >> (NOISE_UNIFORM_BITS - 1 - NOISE_MANTISSA_BITS)) &
+            ((1 << NOISE_MANTISSA_BITS) - 1);
+    }
+    // Q12 deviates of at most 5.5, then scaled by sigma.
+    r = noise_radius[e][m];
+    QUAD_UNPACK(sincos_lut_addr[x & (DDS_ROM_NUM_SAMPLES - 1)], i, q);
+    c = (((r * i) >> 15) * n->sigma) >> 12;
+    s = (((r * q) >> 15) * n->sigma) >> 12;
+    return QUAD_PACK(saturate16(c), saturate16(s));
+}
+
+static inline uint32_t xorshift32(uint32_t x) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+void awgn_iq_block(struct noise *n, uint32_t *iq, int count) {
+    int k;
+    uint32_t x = n->state;
+    for (k = 0; k < count; ++k) {
+        x = xorshift32(x);
+        iq[k] = noise_pair(n, x);
+    }
+    n->state = x;
+}
+
+void awgn_block(struct noise *n, int16_t *s, int count) {
+    int k;
+    uint32_t x = n->state;
+    for (k = 0; k + 1 < count; k += 2) {
+        x = xorshift32(x);
+        QUAD_UNPACK(noise_pair(n, x), s[k], s[k + 1]);
+    }
+    if (k < count) {
+        int16_t unused;
+        x = xorshift32(x);
+        QUAD_UNPACK(noise_pair(n, x), s[k], unused);
+        (void)unused;
+    }
+    n->state = x;
 }
@@ -0,0 +1,453 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "json_stream.h"
+
+#define JSON_MAX_DEPTH          16
+
+struct json_cursor {
+    const char *p;
+    const char *end;
+};
+
+static void skip_space(struct json_cursor *c)
+{
+    while (c->p < c->end && (*c->p == ' ' || *c->p == '\t'
+            || *c->p == '\n' || *c->p == '\r'))
+        c->p++;
+}
+
+static int is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static int scan_members(struct json_cursor *c, int depth, json_member_fn fn,
+        void *context);
+static int scan_elements(struct json_cursor *c, int depth);
+
+static int scan_string(struct json_cursor *c, struct json_token *t)
+{
+    c->p++;
+    t->start = c->p;
+    t->type = JSON_STRING;
+    while (c->p < c->end) {
+        const char ch = *c->p;
+        if (ch == '"') {
+            t->length = c->p - t->start;
+            c->p++;
+            return 0;
+        }
+        if ((unsigned char)ch < 0x20)
+            return -1;
+        if (ch == '\\') {
+            if (++c->p >= c->end)
+                return -1;
+        }
+        c->p++;
+    }
+    return -1;
+}
+
+static int scan_digits(struct json_cursor *c)
+{
+    const char *start = c->p;
+    while (c->p < c->end && is_digit(*c->p))
+        c->p++;
+    return c->p > start ? 0 : -1;
+}
+
+static int scan_number(struct json_cursor *c, struct json_token *t)
+{
+    t->start = c->p;
+    t->type = JSON_NUMBER;
+    if (*c->p == '-')
+        c->p++;
+    if (scan_digits(c) < 0)
+        return -1;
+    if (c->p < c->end && *c->p == '.') {
+        c->p++;
+        if (scan_digits(c) < 0)
+            return -1;
+    }
+    if (c->p < c->end && (*c->p == 'e' || *c->p == 'E')) {
+        c->p++;
+        if (c->p < c->end && (*c->p == '+' || *c->p == '-'))
+            c->p++;
+        if (scan_digits(c) < 0)
+            return -1;
+    }
+    t->length = c->p - t->start;
+    return 0;
+}
+
+static int scan_literal(struct json_cursor *c, struct json_token *t,
+        const char *word, enum json_type type)
+{
+    const size_t n = strlen(word);
+    if ((size_t)(c->end - c->p) < n || memcmp(c->p, word, n) != 0)
+        return -1;
+    t->start = c->p;
+    t->length = n;
+    t->type = type;
+    c->p += n;
+    return 0;
+}
+
+static int scan_value(struct json_cursor *c, int depth, struct json_token *t)
+{
+    if (c->p >= c->end)
+        return -1;
+    switch (*c->p) {
+    case '"':
+        return scan_string(c, t);
+    case '{':
+    case '[':
+        if (depth >= JSON_MAX_DEPTH)
+            return -1;
+        t->start = c->p;
+        t->type = *c->p == '{' ? JSON_OBJECT : JSON_ARRAY;
+        c->p++;
+        if ((t->type == JSON_OBJECT
+                ? scan_members(c, depth + 1, 0, 0)
+                : scan_elements(c, depth + 1)) != 0)
+            return -1;
+        t->length = c->p - t->start;
+        return 0;
+    case 't':
+        return scan_literal(c, t, "true", JSON_TRUE);
+    case 'f':
+        return scan_literal(c, t, "false", JSON_FALSE);
+    case 'n':
+        return scan_literal(c, t, "null", JSON_NULL);
+    default:
+        return scan_number(c, t);
+    }
+}
+
+/*
+ * Scans from just after '{' to just after the matching '}'.
+ */
+static int scan_members(struct json_cursor *c, int depth, json_member_fn fn,
+        void *context)
+{
+    struct json_token name, value;
+    int result;
+
+    skip_space(c);
+    if (c->p < c->end && *c->p == '}') {
+        c->p++;
+        return 0;
+    }
+    for (;;) {
+        skip_space(c);
+        if (c->p >= c->end || *c->p != '"' || scan_string(c, &name) < 0)
+            return -1;
+        skip_space(c);
+        if (c->p >= c->end || *c->p++ != ':')
+            return -1;
+        skip_space(c);
+        if (scan_value(c, depth, &value) < 0)
+            return -1;
+        if (fn && (result = fn(&name, &value, context)) != 0)
+            return result;
+        skip_space(c);
+        if (c->p >= c->end)
+            return -1;
+        if (*c->p == '}') {
+            c->p++;
+            return 0;
+        }
+        if (*c->p++ != ',')
+            return -1;
+    }
+}
+
+static int scan_elements(struct json_cursor *c, int depth)
+{
+    struct json_token value;
+
+    skip_space(c);
+    if (c->p < c->end && *c->p == ']') {
+        c->p++;
+        return 0;
+    }
+    for (;;) {
+        skip_space(c);
+        if (scan_value(c, depth, &value) < 0)
+            return -1;
+        skip_space(c);
+        if (c->p >= c->end)
+            return -1;
+        if (*c->p == ']') {
+            c->p++;
+            return 0;
+        }
+        if (*c->p++ != ',')
+            return -1;
+    }
+}
+
+int json_scan_object(const char *text, size_t length, json_member_fn fn,
+        void *context)
+{
+    struct json_cursor c;
+    int result;
+
+    c.p = text;
+    c.end = text + length;
+    skip_space(&c);
+    if (c.p >= c.end || *c.p++ != '{')
+        return -1;
+    if ((result = scan_members(&c, 1, fn, context)) != 0)
+        return result;
+    // Some senders count the terminating NUL in the frame.
+    skip_space(&c);
+    while (c.p < c.end && *c.p == '\0')
+        c.p++;
+    return c.p == c.end ? 0 : -1;
+}
+
+int json_token_equals(const struct json_token *t, const char *s)
+{
+    const size_t n = strlen(s);
+    return t->type == JSON_STRING && t->length == n
+        && memcmp(t->start, s, n) == 0;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+int json_token_copy(const struct json_token *t, char *dst, size_t size)
+{
+    const char *p = t->start;
+    const char *const end = t->start + t->length;
+    size_t n = 0;
+
+    if (t->type != JSON_STRING || size == 0)
+        return -1;
+    while (p < end) {
+        char ch = *p++;
+        if (ch == '\\' && p < end) {
+            ch = *p++;
+            switch (ch) {
+            case 'b': ch = '\b'; break;
+            case 'f': ch = '\f'; break;
+            case 'n': ch = '\n'; break;
+            case 'r': ch = '\r'; break;
+            case 't': ch = '\t'; break;
+            case 'u': {
+                int code = 0, i;
+                for (i = 0; i < 4 && p < end; ++i) {
+                    const int h = hex_value(*p++);
+                    if (h < 0)
+                        return -1;
+                    code = (code << 4) | h;
+                }
+                if (i < 4)
+                    return -1;
+                ch = code < 0x80 ? (char)code : '?';
+                break;
+            }
+            default:
+                break;
+            }
+        }
+        if (n + 1 >= size) {
+            dst[n] = '\0';
+            return -1;
+        }
+        dst[n++] = ch;
+    }
+    dst[n] = '\0';
+    return 0;
+}
+
+int json_token_double(const struct json_token *t, double *value)
+{
+    char buf[32];
+    char *end;
+
+    if (t->type != JSON_NUMBER || t->length >= sizeof(buf))
+        return -1;
+    memcpy(buf, t->start, t->length);
+    buf[t->length] = '\0';
+    *value = strtod(buf, &end);
+    return *end == '\0' ? 0 : -1;
+}
+
+void json_writer_init(struct json_writer *w, char *buf, size_t size)
+{
+    w->start = w->p = buf;
+    w->end = buf + size;
+    w->need_comma = 0;
+    w->overflowed = 0;
+}
+
+size_t json_writer_length(const struct json_writer *w)
+{
+    return w->p - w->start;
+}
+
+int json_writer_overflowed(const struct json_writer *w)
+{
+    return w->overflowed;
+}
+
+static void put(struct json_writer *w, const char *s, size_t n)
+{
+    if (w->overflowed)
+        return;
+    if ((size_t)(w->end - w->p) < n) {
+        w->overflowed = 1;
+        return;
+    }
+    memcpy(w->p, s, n);
+    w->p += n;
+}
+
+static void put_escaped(struct json_writer *w, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *run = s;
+
+    put(w, "\"", 1);
+    for (; *s; ++s) {
+        const unsigned char ch = *s;
+        char escape[6];
+        size_t n = 2;
+
+        if (ch >= 0x20 && ch != '"' && ch != '\\')
+            continue;
+        put(w, run, s - run);
+        run = s + 1;
+        escape[0] = '\\';
+        switch (ch) {
+        case '"': escape[1] = '"'; break;
+        case '\\': escape[1] = '\\'; break;
+        case '\n': escape[1] = 'n'; break;
+        case '\r': escape[1] = 'r'; break;
+        case '\t': escape[1] = 't'; break;
+        default:
+            escape[1] = 'u';
+            escape[2] = '0';
+            escape[3] = '0';
+            escape[4] = hex[ch >> 4];
+            escape[5] = hex[ch & 0xf];
+            n = 6;
+        }
+        put(w, escape, n);
+    }
+    put(w, run, s - run);
+    put(w, "\"", 1);
+}
+
+static void prefix(struct json_writer *w, const char *name)
+{
+    if (w->need_comma)
+        put(w, ",", 1);
+    if (name) {
+        put_escaped(w, name);
+        put(w, ":", 1);
+    }
+    w->need_comma = 1;
+}
+
+void json_object_begin(struct json_writer *w, const char *name)
+{
+    prefix(w, name);
+    put(w, "{", 1);
+    w->need_comma = 0;
+}
+
+void json_object_end(struct json_writer *w)
+{
+    put(w, "}", 1);
+    w->need_comma = 1;
+}
+
+void json_array_begin(struct json_writer *w, const char *name)
+{
+    prefix(w, name);
+    put(w, "[", 1);
+    w->need_comma = 0;
+}
+
+void json_array_end(struct json_writer *w)
+{
+    put(w, "]", 1);
+    w->need_comma = 1;
+}
+
+void json_write_string(struct json_writer *w, const char *name,
+        const char *value)
+{
+    prefix(w, name);
+    put_escaped(w, value ? value : "");
+}
+
+// printf is slow on the target, and integers are most of what we write.
+static void put_long(struct json_writer *w, long value)
+{
+    char buf[24];
+    char *p = &buf[sizeof(buf)];
+    unsigned long u = value < 0 ? 0UL - (unsigned long)value
+        : (unsigned long)value;
+
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (value < 0)
+        *--p = '-';
+    put(w, p, &buf[sizeof(buf)] - p);
+}
+
+void json_write_long(struct json_writer *w, const char *name, long value)
+{
+    prefix(w, name);
+    put_long(w, value);
+}
+
+void json_write_number(struct json_writer *w, const char *name,
+        double value)
+{
+    char buf[32];
+    int n;
+
+    prefix(w, name);
+    // JSON has no NaN or infinity.
+    if (value != value || value - value != 0) {
+        put(w, "null", 4);
+        return;
+    }
+    if (value >= -2147483647.0 && value <= 2147483647.0
+            && (double)(long)value == value) {
+        put_long(w, (long)value);
+        return;
+    }
+    n = snprintf(buf, sizeof(buf), "%.10g", value);
+    put(w, buf, n);
+}
+
+void json_write_int_array(struct json_writer *w, const char *name,
+        const int *values, int count)
+{
+    int i;
+
+    json_array_begin(w, name);
+    for (i = 0; i < count; ++i) {
+        if (i)
+            put(w, ",", 1);
+        put_long(w, values[i]);
+    }
+    json_array_end(w);
+}
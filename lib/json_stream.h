@@ -0,0 +1,109 @@
+#ifndef __JSON_STREAM_H__
+#define __JSON_STREAM_H__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A JSON scanner and writer for the websocket path, which neither
+ * allocates nor builds a tree.  cJSON is still there for anything that
+ * needs a whole document.
+ */
+
+enum json_type {
+    JSON_STRING,
+    JSON_NUMBER,
+    JSON_TRUE,
+    JSON_FALSE,
+    JSON_NULL,
+    JSON_OBJECT,
+    JSON_ARRAY
+};
+
+/*
+ * A span of the text being scanned.  Strings exclude their quotes and are
+ * left escaped; objects and arrays include their brackets.
+ */
+struct json_token {
+    const char *start;
+    size_t length;
+    enum json_type type;
+};
+
+/*
+ * Called for each member of the top level object.  A nonzero return stops
+ * the scan and is returned from json_scan_object().
+ */
+typedef int (*json_member_fn)(const struct json_token *name,
+        const struct json_token *value, void *context);
+
+/*
+ * Scans one object from text, which need not be NUL terminated.  Nested
+ * objects and arrays are checked and passed whole.  Returns 0, -1 if the
+ * text isn't a well formed object, or what the callback returned.
+ */
+int json_scan_object(const char *text, size_t length, json_member_fn fn,
+        void *context);
+
+/*
+ * True if the token is a string equal to s.  The token is compared as
+ * written, so s should be something that needs no escaping.
+ */
+int json_token_equals(const struct json_token *t, const char *s);
+
+/*
+ * Unescapes a string token into dst as a C string.  \u escapes outside
+ * ASCII become '?'.  Returns -1 if it doesn't fit.
+ */
+int json_token_copy(const struct json_token *t, char *dst, size_t size);
+
+/*
+ * Converts a number token.  Returns -1 for anything else.
+ */
+int json_token_double(const struct json_token *t, double *value);
+
+/*
+ * Formats JSON straight into a caller's buffer.  name is the member name
+ * inside an object and NULL inside an array or at the top level.  Once
+ * the buffer fills the writer stops and json_writer_overflowed() is true,
+ * so a caller can retry with a larger one.  The output is not NUL
+ * terminated.
+ */
+struct json_writer {
+    char *start;
+    char *p;
+    char *end;
+    int need_comma;
+    int overflowed;
+};
+
+void json_writer_init(struct json_writer *w, char *buf, size_t size);
+size_t json_writer_length(const struct json_writer *w);
+int json_writer_overflowed(const struct json_writer *w);
+
+void json_object_begin(struct json_writer *w, const char *name);
+void json_object_end(struct json_writer *w);
+void json_array_begin(struct json_writer *w, const char *name);
+void json_array_end(struct json_writer *w);
+
+void json_write_string(struct json_writer *w, const char *name,
+        const char *value);
+void json_write_long(struct json_writer *w, const char *name, long value);
+
+/*
+ * Whole numbers are written as integers; the rest with %g.
+ */
+void json_write_number(struct json_writer *w, const char *name,
+        double value);
+
+void json_write_int_array(struct json_writer *w, const char *name,
+        const int *values, int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __JSON_STREAM_H__ */
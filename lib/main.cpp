@@ -1,11 +1,16 @@
 #include <iostream>
 #include <cstdlib>
+#include <cmath>
 #include <alsa/asoundlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <getopt.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <vector>
 
 #include "dsp.h"
+#include "spsc_ring.h"
 
 #include "cJSON.h"
 #include "radio.h"
@@ -20,6 +25,20 @@ static int verbose = 0;
 static unsigned int tone1 = 400;
 static unsigned int tone2 = 1900;
 
+// RMS level of the noise source, in dB relative to full scale.
+static double noise_level = -18.;
+static struct noise noise;
+
+// Spectrum frames sent to web clients.
+static int spectrum_bins = 512;
+static int spectrum_rate = 10;
+
+// Free websocket buffers kept per size class.
+static int buffer_pool = WRITE_BUFFER_CAPACITY;
+
+// Most buffers queued to one websocket client.
+static int queue_depth = SERVER_QUEUE_DEPTH;
+
 static int modem_enabled = 0;
 static int server_enabled = 1;
 static int file_enabled = 0;
@@ -27,60 +46,53 @@ static int playback_enabled = 0;
 static int capture_enabled = 0;
 
 #define AUDIO_RING_SIZE 4096
-static int16_t audio_ring[AUDIO_RING_SIZE];
-static int audio_ring_head = 0;
-static int audio_ring_tail = 0;
+static spsc_ring<int16_t, AUDIO_RING_SIZE> audio_ring;
 
-int16_t mute_source(void) {
-    return 0;
+int mute_source(int16_t *samples, int count) {
+    memset(samples, 0, count * sizeof(int16_t));
+    return count;
 }
 
-int16_t tone_source(void) {
-    static int16_t d = 0;
-    int16_t i, q;
-    sincos16(fcw1, &phase1, &i, &q);
-    // Apply a CW shaping mask
-    //if (d < (1 << 14) - 1)
-    //    d += 1;
-    //return (int16_t)(((int32_t)d * (int32_t)i) >> 15);
-    return i >> 2; //QUAD_PACK(i >> 1, q >> 1);
+int tone_source(int16_t *samples, int count) {
+    cos16_block(fcw1, &phase1, samples, count);
+    for (int i = 0; i < count; ++i)
+        samples[i] >>= 2;
+    return count;
 }
 
-int16_t tone2_source(void) {
-    int16_t i1, q1, i2, q2;
-    sincos16(fcw1, &phase1, &i1, &q1);
-    sincos16(fcw2, &phase2, &i2, &q2);
-    //return (i1 / 2 + i2 / 2);
-    int16_t i3 = i1 >> 2 + i2 >> 2;
-    //int16_t q3 = q1 >> 2 + q2 >> 2;
-    return i3 >> 1;
+#define TONE_BLOCK_SIZE 64
+
+int tone2_source(int16_t *samples, int count) {
+    int16_t second[TONE_BLOCK_SIZE];
+    const int total = count;
+    while (count > 0) {
+        int n = count < TONE_BLOCK_SIZE ? count : TONE_BLOCK_SIZE;
+        cos16_block(fcw1, &phase1, samples, n);
+        cos16_block(fcw2, &phase2, second, n);
+        for (int i = 0; i < n; ++i)
+            samples[i] = ((samples[i] >> 2) + (second[i] >> 2)) >> 1;
+        samples += n;
+        count -= n;
+    }
+    return total;
 }
 
-int16_t awgn_source(void) {
-    int16_t s;
-    awgn(&s);
-    return s;
+int awgn_source(int16_t *samples, int count) {
+    awgn_block(&noise, samples, count);
+    return count;
 }
 
 // Read data from the microphone source, which is stored in the audio
-// ring buffer.
-int16_t mic_source(void) {
-    int16_t sample;
-    int end = AUDIO_RING_SIZE - audio_ring_tail;
-    int n = (end + audio_ring_head) & (AUDIO_RING_SIZE - 1);
-    int data = n < end ? n : end;
-    if (data <= 0) {
-        sample = 0;
-    } else {
-        sample = audio_ring[audio_ring_tail];
-        audio_ring_tail = (audio_ring_tail + 1) & (AUDIO_RING_SIZE - 2);
-    }
-    return sample;
+// ring buffer.  Only what has been captured so far; no silence is made up.
+int mic_source(int16_t *samples, int count) {
+    int n = audio_ring.fill();
+    return audio_ring.read(samples, n < count ? n : count);
 }
 
-int16_t modem_source(void) {
+int modem_source(int16_t *samples, int count) {
     // TODO
-    return 0;
+    memset(samples, 0, count * sizeof(int16_t));
+    return count;
 }
 
 struct sources_list {
@@ -99,30 +111,21 @@ static const struct sources_list sources_list[] = {
 };
 
 int sink_space() {
-    int end = AUDIO_RING_SIZE - 1 - audio_ring_head;
-    int n = (end + audio_ring_tail) & (AUDIO_RING_SIZE - 1);
-    int space = n <= end ? n : end + 1;
-    return space;
+    return audio_ring.capacity() - audio_ring.fill();
 }
 
 // Write data into the audio ring buffer, to be played on the speakers.
-void speaker_sink(int16_t sample) {
-    int space = sink_space();
-    if (space <= 0) {
-        // Audio ring just drops samples; let's catch up!
-        return;
-    } else {
-        audio_ring[audio_ring_head] = sample;
-        audio_ring_head = (audio_ring_head + 1) & (AUDIO_RING_SIZE - 1);
-    }
+// Whatever doesn't fit is dropped; let's catch up!
+void speaker_sink(const int16_t *samples, int count) {
+    audio_ring.write(samples, count);
 }
 
-void null_sink(int16_t sample) {
+void null_sink(const int16_t *samples, int count) {
     // Drop all of the samples.
     return;
 }
 
-void modem_sink(int16_t sample) {
+void modem_sink(const int16_t *samples, int count) {
     // TODO: do the bit manipulations to set up AFSK.
     // TODO: enqueue the samples; we can't drop these, so return an error.
     // TODO: we can't return an error, yet.
@@ -151,6 +154,8 @@ void *server_init() {
         fprintf(stderr, "Can't allocate memory.\n");
         return NULL;
     }
+    write_buffer_pool_configure(buffer_pool);
+    server_set_queue_depth(queue_depth);
     if (!server_start(0, 80, false)) {
         fprintf(stderr, "Can't start the server.\n");
         free(server);
@@ -191,13 +196,21 @@ struct resource_ops server_ops = {
 
 
 
-struct file_source {
+struct file_source : public poll_handler {
     int fd;
+
+    void ready(int fd, unsigned int revents);
 };
 
+void file_source_to_sink(int fd);
+
+void file_source::ready(int fd, unsigned int revents) {
+    file_source_to_sink(fd);
+}
+
 void *file_source_init() {
     struct file_source *file_source;
-    file_source = (struct file_source*)malloc(sizeof(struct file_source));
+    file_source = new struct file_source;
     if (file_source == NULL) {
         fprintf(stderr, "Can't allocate memory.\n");
         return NULL;
@@ -205,10 +218,10 @@ void *file_source_init() {
     file_source->fd = open("/mnt/whitebox/gnuradio/audio_50k.samples", O_RDONLY | O_NONBLOCK);
     if (file_source->fd < 0) {
         perror("file_source open");
-        free(file_source);
+        delete file_source;
         return NULL;
     }
-    poll_start_fd(0, file_source->fd, POLLIN, FILE_SOURCE_FD);
+    poll_start_fd(file_source->fd, POLLIN, file_source);
     return file_source;
 }
 
@@ -216,7 +229,7 @@ void file_source_close(void *data) {
     struct file_source *file_source = (struct file_source *)data;
     poll_end_fd(file_source->fd);
     close(file_source->fd);
-    free(file_source);
+    delete file_source;
 }
 
 int file_source_descriptors_count(void *data) {
@@ -245,10 +258,7 @@ void file_source_to_sink(int fd) {
             std::cerr << "reset file" << std::endl;
             lseek(fd, 0, SEEK_SET);
         } else {
-            for (int i = 0; i < count / 2; ++i) {
-                //std::cerr << ' ' << audio_data[i];
-                sink(audio_data[i]);
-            }
+            sink(audio_data, count / 2);
             //std::cerr << std::endl;
         }
     }
@@ -267,141 +277,108 @@ struct resource_ops file_source_ops = {
 
 
 
-static const unsigned int max_fd_count = 1024;
-static unsigned int fd_count = 0;
-pollfd fds[max_fd_count] = { };
-libwebsocket_context * websocket_contexts[max_fd_count] = { };
-static int whitebox_fd = -1;
-static int file_source_fd = -1;
+// The main loop waits on epoll.  Each descriptor has a handler object,
+// found by indexing poll_entries with the fd, so adding, changing and
+// removing one never scans the others.
+#define POLL_MAX_EVENTS 32
 
-void
-poll_initialize_contexts()
-{
-    for (int i = 0; i < max_fd_count; ++i) {
-        websocket_contexts[i] = 0;
-    }
-}
+struct poll_entry {
+    poll_handler *handler;
+    unsigned int events;
+};
 
-void
-poll_debug_fds()
+static int epoll_fd = -1;
+static unsigned int poll_count = 0;
+static std::vector<poll_entry> poll_entries;
+
+static int
+poll_ctl(int op, int fd, unsigned int events)
 {
-    for ( unsigned int i = 0; i < fd_count; i++ ) {
-      fprintf(stderr, "\tfd=%d, events=%d, revents=%d, type=%s\n",
-        fds[i].fd, fds[i].events, fds[i].revents,
-        websocket_contexts[i] ? "websocket" : "whitebox" );
-    }
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    // The POLL and EPOLL event bits have the same values.
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(epoll_fd, op, fd, &ev);
 }
 
 void
-poll_start_fd(libwebsocket_context * context, int fd, int events, int type)
+poll_start_fd(int fd, int events, poll_handler * handler, bool edge)
 {
-  fprintf(stderr, "poll_start_fd %d websocket?%s\n", fd, context ? "yes" : "no");
-   if ( fd_count >= max_fd_count ) {
-     std::cerr << "fd_count too large in poll_start_fd().";
-     return;
-   }
-   pollfd * f = &fds[fd_count];
-   f->fd = fd;
-   f->events = events;
-   f->revents = 0;
-   websocket_contexts[fd_count] = context;
-   fd_count++;
-   poll_debug_fds();
-   if (type == WHITEBOX_FD) // a little hacky.
-     whitebox_fd = fd;
-   if (type == FILE_SOURCE_FD)
-     file_source_fd = fd;
+    if ( epoll_fd < 0 && (epoll_fd = epoll_create(POLL_MAX_EVENTS)) < 0 ) {
+        perror("epoll_create");
+        exit(-1);
+    }
+    if ( fd < 0 )
+        return;
+    if ( (unsigned int)fd >= poll_entries.size() ) {
+        poll_entry empty = { 0, 0 };
+        poll_entries.resize(fd + 1, empty);
+    }
+    poll_entry & e = poll_entries[fd];
+    e.events = events | (edge ? EPOLLET : 0);
+    if ( poll_ctl(e.handler ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, e.events) < 0 ) {
+        perror("poll_start_fd");
+        return;
+    }
+    if ( !e.handler )
+        poll_count++;
+    e.handler = handler;
 }
 
 void
 poll_change_fd(int fd, int events)
 {
-  fprintf(stderr, "poll_change_fd %d\n", fd);
-  for ( unsigned int i = 0; i < fd_count; i++ ) {
-    if ( fds[i].fd == fd ) {
-      fds[i].events = events;
-      poll_debug_fds();
-      return;
+    if ( fd < 0 || (unsigned int)fd >= poll_entries.size()
+     || !poll_entries[fd].handler ) {
+        std::cerr << "fd " << fd << " not found in poll_change_fd()." << std::endl;
+        return;
     }
-  }
-  std::cerr << "fd not found in poll_change_fd()." << std::endl;
-  exit(-1);
+    poll_entry & e = poll_entries[fd];
+    e.events = events | (e.events & EPOLLET);
+    if ( poll_ctl(EPOLL_CTL_MOD, fd, e.events) < 0 )
+        perror("poll_change_fd");
 }
 
 void
 poll_end_fd(int fd)
 {
-  for ( unsigned int i = 0; i < fd_count; i++ ) {
-    if ( fds[i].fd == fd ) {
-      if ( --fd_count > i ) {
-        fds[i] = fds[fd_count];
-        websocket_contexts[i] = websocket_contexts[fd_count];
-      }
-      memset(&fds[fd_count], 0, sizeof(*fds));
-      memset(&websocket_contexts[fd_count], 0, sizeof(*websocket_contexts));
-      poll_debug_fds();
-      return;
+    if ( fd < 0 || (unsigned int)fd >= poll_entries.size()
+     || !poll_entries[fd].handler ) {
+        std::cerr << "fd " << fd << " not found in poll_end_fd()." << std::endl;
+        return;
     }
-  }
-  poll_debug_fds();
-  std::cerr << "fd " << fd << " not found in poll_end_fd(), fd_count is " << fd_count << std::endl;
+    // The fd may already be closed, which removes it from epoll anyway.
+    poll_ctl(EPOLL_CTL_DEL, fd, 0);
+    poll_entries[fd].handler = 0;
+    poll_entries[fd].events = 0;
+    poll_count--;
 }
 
 int transfer_loop(struct resource *resources, int resource_count) {
-    signed short *ptr;
-    int status, cptr;
-
-    int i;
+    epoll_event events[POLL_MAX_EVENTS];
 
-    if (fd_count <= 0) {
+    if (poll_count <= 0) {
         std::cerr << "no fds to watch" << std::endl;
         return -1;
     }
 
     // The main loop
     while (1) {
-        // First, poll.
-        status = poll(fds, fd_count, -1);
+        int status = epoll_wait(epoll_fd, events, POLL_MAX_EVENTS, -1);
 
         if (status < 0) {
-            perror("poll");
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
             exit(-1);
-        } else if (status == 0) {
-            //fprintf(stderr, "Nothing to poll\n");
-            //poll_debug_fds();
         }
-        else if (status > 0) {
-          int serviced = 0;
-          for ( unsigned int i = 0; serviced < status && i < fd_count; i++ ) {
-            if ( fds[i].revents && websocket_contexts[i] ) {
-              server_service_fd(websocket_contexts[i], &fds[i]);
-              serviced++;
-            } else if ( fds[i].revents && fds[i].fd == whitebox_fd ) {  // the whitebox
-                if (fds[i].revents & POLLOUT) {
-                    //fprintf(stderr, "pollout\n");
-                    modem_write();
-                }
-                if (fds[i].revents & POLLIN) {
-                    //fprintf(stderr, "pollin\n");
-                    //modem_read();
-                }
-                if (fds[i].revents & POLLERR) {
-                    //fprintf(stderr, "pollerr\n");
-                    modem_recover();
-                }
-                serviced++;
-            } else if (fds[i].revents && fds[i].fd == file_source_fd) {
-                file_source_to_sink(fds[i].fd);
-                serviced++;
-            }
-          }
-          if ( serviced != status ) {
-            std::cerr << "Didn't find file descriptor to service." << std::endl;
-            fprintf(stderr, "fd_count is %d\n", fd_count);
-            fprintf(stderr, "status count is %d\n", status);
-            fprintf(stderr, "serviced count is %d\n", serviced);
-            poll_debug_fds();
-          }
+        for (int i = 0; i < status; ++i) {
+            int fd = events[i].data.fd;
+            // A handler earlier in this batch may have ended this fd.
+            if ((unsigned int)fd < poll_entries.size()
+                    && poll_entries[fd].handler)
+                poll_entries[fd].handler->ready(fd, events[i].events);
         }
     }
 
@@ -410,6 +387,8 @@ int transfer_loop(struct resource *resources, int resource_count) {
 
 int parse_args(int argc, char **argv) {
     int i, source_found = 0, sink_found = 0;
+    int priority = -1, cpu = -1;
+    int tx_latency = -1, tx_pacing = -1;
 
     struct option long_option[] = {
         { "help", 0, NULL, 'h' },
@@ -424,12 +403,22 @@ int parse_args(int argc, char **argv) {
         { "verbose", 1, NULL, 'v' },
         { "source", 1, NULL, 'u' },
         { "sink", 1, NULL, 'i' },
+        { "noise", 1, NULL, 'N' },
+        { "tuning-window", 1, NULL, 'w' },
+        { "spectrum-bins", 1, NULL, 'B' },
+        { "spectrum-rate", 1, NULL, 'R' },
+        { "priority", 1, NULL, 'P' },
+        { "cpu", 1, NULL, 'C' },
+        { "tx-latency", 1, NULL, 'L' },
+        { "tx-pacing", 1, NULL, 'T' },
+        { "buffer-pool", 1, NULL, 'Q' },
+        { "queue-depth", 1, NULL, 'q' },
         { NULL, 0, NULL, 0 },
     };
 
     while (1) {
         int c;
-        if ((c = getopt_long(argc, argv, "hD:r:c:f:b:p:m:o:vu:i:ne", long_option, NULL)) < 0)
+        if ((c = getopt_long(argc, argv, "hD:r:c:f:b:p:m:o:vu:i:neN:w:B:R:P:C:L:T:Q:q:", long_option, NULL)) < 0)
             break;
         switch (c) {
             case 'h':
@@ -462,6 +451,40 @@ int parse_args(int argc, char **argv) {
             case 'v':
                 verbose = 1;
                 break;
+            case 'N':
+                noise_level = atof(optarg);
+                if (noise_level > 0.)
+                    noise_level = 0.;
+                break;
+            case 'w':
+                modem_set_tuning_window(atof(optarg));
+                break;
+            case 'B':
+                spectrum_bins = atoi(optarg);
+                break;
+            case 'R':
+                spectrum_rate = atoi(optarg);
+                break;
+            case 'P':
+                priority = atoi(optarg);
+                break;
+            case 'C':
+                cpu = atoi(optarg);
+                break;
+            case 'L':
+                tx_latency = atoi(optarg);
+                break;
+            case 'T':
+                tx_pacing = atoi(optarg);
+                break;
+            case 'q':
+                queue_depth = atoi(optarg);
+                break;
+            case 'Q':
+                buffer_pool = atoi(optarg);
+                if (buffer_pool < 0)
+                    buffer_pool = 0;
+                break;
             case 'u':
                 // select source
                 for (i = 0; sources_list[i].next; ++i) {
@@ -490,6 +513,8 @@ int parse_args(int argc, char **argv) {
                 break;
         }
     }
+    modem_set_thread(priority, cpu);
+    modem_set_tx_pacing(tx_latency, tx_pacing);
     if (!device)
         device = strdup("default");
     return 0;
@@ -500,8 +525,6 @@ int main(int argc, char **argv) {
     int resource_count = 0;
     int i;
 
-    poll_initialize_contexts();
-
     // Defaults
     source = &mic_source;
     sink = &speaker_sink;
@@ -510,12 +533,21 @@ int main(int argc, char **argv) {
     if (parse_args(argc, argv) < 0)
         return -1;
 
+    // Sources and sinks run at the RF sample rate; the soundcard resources
+    // resample to and from whatever rate ALSA was opened at.
+    stream_rate = RF_SAMPLE_RATE;
+
     // Recompute DDS words based on final sample rate
-    fcw1 = freq_to_fcw(tone1, rate);
-    fcw2 = freq_to_fcw(tone2, rate);
+    fcw1 = freq_to_fcw(tone1, stream_rate);
+    fcw2 = freq_to_fcw(tone2, stream_rate);
 
     // Initialize DSP library
     dsp_init();
+    noise_init(&noise, 1, (int16_t)(32767. * pow(10., noise_level / 20.)));
+    if (radio_spectrum_configure(spectrum_bins, spectrum_rate) < 0) {
+        fprintf(stderr, "Invalid spectrum bin count: %d\n", spectrum_bins);
+        return -1;
+    }
 
     if (modem_enabled) {
         if (resource_setup(&resources[resource_count++], "modem",
@@ -1,107 +1,318 @@
 #include <iostream>
 #include <cstdlib>
+#include <cerrno>
 #include <cstring>
+#include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/ioctl.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 #include "whitebox.h"
 #include "modem.h"
 #include "radio.h"
 #include "dsp.h"
+#include "spsc_ring.h"
 
-#define RF_SAMPLE_RATE 50000
+// Peak FM deviation in Hz, and the matching phase step per sample at full
+// scale audio in Q15 radians.
+#define FM_DEVIATION 5e3
+#define SENSITIVITY ((int16_t)((2. * 3.1415926 * FM_DEVIATION / RF_SAMPLE_RATE) * 32767))
 
-#define SENSITIVITY ((int16_t)((2. * 3.1415926 * 5e3 / (RF_SAMPLE_RATE * 2.)) * 32767))
+#define MODEM_BLOCK_SIZE 1024
+
+// Most samples taken from the receive buffer per modem_read().
+#define MODEM_READ_BATCH (8 * MODEM_BLOCK_SIZE)
+
+// Receive buffer level that wakes us up.
+#define MODEM_RX_LATENCY_MS 20
+
+// Transmit buffer level the driver holds us to.  Paced transmits fill back
+// up to it, tx_pacing times per latency period, from a timer instead of
+// waking on every POLLOUT.
+#define MODEM_TX_LATENCY_MS 10
+
+// Frequency changes within this distance of the synthesizer are made with
+// the digital mixer instead of relocking the PLL.
+#define MODEM_TUNING_WINDOW 10e3
 
 static struct whitebox wb;
 static struct whitebox *whitebox;
-static bool started = false;
 static bool txing = false;
 static bool rxing = false;
 static char mode[5];
-static uint32_t fcw;
-static uint32_t phase;
 
-typedef uint32_t (*modulator)(int16_t);
-typedef int16_t (*demodulator)(uint32_t);
+// Where the synthesizer is tuned, and the mixers making up the difference
+// to whitebox->frequency.
+static float lo_frequency;
+static float tuning_window = MODEM_TUNING_WINDOW;
+static struct mixer tx_mixer, rx_mixer;
+
+// Times the receiver had to be recovered, normally after an overrun, and
+// the transmitter after an underrun.
+static volatile unsigned int rx_overruns = 0;
+static volatile unsigned int tx_underruns = 0;
+// Transmit audio samples the modem thread had to make up as silence
+// because the I/O thread hadn't filled tx_audio in time.
+static volatile unsigned long tx_starved = 0;
+
+static int tx_latency_ms = MODEM_TX_LATENCY_MS;
+static int tx_pacing = 0;
+static int timer_fd = -1;
+
+// Transmit buffer level found by each paced wakeup.
+static volatile unsigned int fill_histogram[MODEM_FILL_BUCKETS];
+
+// Samples go to and from the whitebox on a thread of their own, so that
+// the web server and ALSA can't hold up the DMA buffers.  The I/O thread
+// only talks to it through the rings below; each ring has a pipe next to
+// it to wake the other side up.
+#define MODEM_THREAD_PRIORITY 40
+#define MODEM_COMMANDS 32
+#define MODEM_RX_RING (8 * MODEM_BLOCK_SIZE)
+#define MODEM_TX_RING (4 * MODEM_BLOCK_SIZE)
+
+enum modem_command_type {
+    MODEM_TRANSMIT,
+    MODEM_RECEIVE,
+    MODEM_STANDBY,
+    MODEM_FREQUENCY,
+    MODEM_MODE,
+    MODEM_SCAN,
+    MODEM_QUIT,
+};
+
+struct modulators_list;
+
+struct modem_command {
+    enum modem_command_type type;
+    float frequency;
+    const struct modulators_list *mode;
+};
+
+static int thread_priority = MODEM_THREAD_PRIORITY;
+static int thread_cpu = -1;
+static pthread_t thread;
+static bool thread_running = false;
+static int command_pipe[2] = { -1, -1 };
+static int notify_pipe[2] = { -1, -1 };
+static spsc_ring<struct modem_command, MODEM_COMMANDS> commands;
+
+// Receive results waiting for the I/O thread: demodulated audio for the
+// websocket client, and I/Q for the spectrum.
+static spsc_ring<int16_t, MODEM_RX_RING> rx_audio;
+static spsc_ring<uint32_t, MODEM_RX_RING> rx_iq;
+
+// Audio for the transmitter, which only the I/O thread fills from
+// source(), so the source and sink callbacks are never called from the
+// modem thread.
+static spsc_ring<int16_t, MODEM_TX_RING> tx_audio;
+
+// What the I/O thread last asked for, so it can report it without reaching
+// into the modem thread.
+static float requested_frequency;
+
+// Scans are too big for the command ring, so the request and the results
+// are handed over under a lock instead.
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static float scan_request[MODEM_SCAN_MAX];
+static int scan_request_count = 0;
+static int scan_dwell_ms = 0;
+static struct whitebox_scan_channel scan_channels[MODEM_SCAN_MAX];
+static struct whitebox_scan_channel scan_results[MODEM_SCAN_MAX];
+static int scan_result_count = 0;
+static float scan_rate = 0;
+// Counts finished scans.  Only the modem thread bumps it; modem_drain()
+// reports each change on the I/O thread.
+static volatile unsigned int scans_finished = 0;
+static unsigned int scans_reported = 0;
+
+// Modes convert a whole block between audio and packed I/Q at a time.  The
+// state pointer belongs to the mode, so filters and oscillators carry over
+// from one block to the next.
+typedef void (*modulator)(void *state, const int16_t *audio, uint32_t *iq,
+        int count);
+typedef void (*demodulator)(void *state, const uint32_t *iq, int16_t *audio,
+        int count);
+typedef void (*modulator_reset)(void *state);
 
 struct modulators_list {
     const char *name;
     modulator mod;
     demodulator demod;
+    modulator_reset reset;
+    void *state;
 };
 
-modulator current_mod;
-demodulator current_demod;
+static const struct modulators_list *current;
 
-uint32_t am_mod(int16_t audio) {
-    int16_t a = audio;// + 0x100;
-    uint32_t iq_sample = QUAD_PACK(a, -a);
-    return iq_sample;
+void am_mod(void *state, const int16_t *audio, uint32_t *iq, int count) {
+    for (int n = 0; n < count; ++n) {
+        int16_t a = audio[n];// + 0x100;
+        iq[n] = QUAD_PACK(a, -a);
+    }
 }
 
 #define MAG_ALPHA ((int32_t)(((1 << 15) - 1) * 0.948059448969))
 #define MAG_BETA  ((int32_t)(((1 << 15) - 1) * 0.392699081699))
 
-int16_t am_demod(uint32_t iq) {
-    int16_t i, q;
-    int32_t mAx, mIn;
-    QUAD_UNPACK(iq, i, q);
-    if (i > q) {
-        mAx = i; mIn = q;
-    } else {
-        mAx = q; mIn = i;
+// Alpha max plus beta min magnitude estimate.
+void am_demod(void *state, const uint32_t *iq, int16_t *audio, int count) {
+    for (int n = 0; n < count; ++n) {
+        int16_t i, q;
+        int32_t mAx, mIn;
+        QUAD_UNPACK(iq[n], i, q);
+        mAx = abs(i);
+        mIn = abs(q);
+        if (mIn > mAx) {
+            int32_t t = mAx; mAx = mIn; mIn = t;
+        }
+        audio[n] = (int16_t)(((mAx * MAG_ALPHA) + (mIn * MAG_BETA)) >> 16);
     }
-    return ((int16_t)((mAx * MAG_ALPHA) + (mIn * MAG_BETA)) >> 16);
 }
 
-uint32_t fm_mod(int16_t audio) {
-    return 0;
+struct fm_state {
+    struct fm_modulator mod;
+    struct fm_demodulator demod;
+};
+
+static struct fm_state fm;
+
+void fm_reset(void *state) {
+    struct fm_state *s = (struct fm_state *)state;
+    fm_modulator_init(&s->mod, SENSITIVITY);
+    fm_demodulator_init(&s->demod, SENSITIVITY);
 }
 
-int16_t fm_demod(uint32_t iq) {
-    return 0;
+void fm_mod(void *state, const int16_t *audio, uint32_t *iq, int count) {
+    struct fm_state *s = (struct fm_state *)state;
+    fm_mod_block(&s->mod, audio, iq, count);
 }
 
-uint32_t cw_mod(int16_t audio) {
-    int16_t i, q;
-    sincos16(fcw, &phase, &i, &q);
-    return QUAD_PACK(i >> 3, -q >> 3);
+void fm_demod(void *state, const uint32_t *iq, int16_t *audio, int count) {
+    struct fm_state *s = (struct fm_state *)state;
+    fm_demod_block(&s->demod, iq, audio, count);
 }
 
-int16_t cw_demod(uint32_t iq) {
-    //int16_t i, q;
-    //sincos16(fcw, &phase, &i, &q);
-    //return i;
-    return 0;
+struct cw_state {
+    uint32_t fcw;
+    uint32_t phase;
+};
+
+static struct cw_state cw;
+
+void cw_reset(void *state) {
+    struct cw_state *s = (struct cw_state *)state;
+    s->phase = 0;
 }
 
-uint32_t usb_mod(int16_t audio) {
-    return 0;
+void cw_mod(void *state, const int16_t *audio, uint32_t *iq, int count) {
+    struct cw_state *s = (struct cw_state *)state;
+    sincos16c_block(s->fcw, &s->phase, iq, count);
+    for (int n = 0; n < count; ++n) {
+        int16_t i, q;
+        QUAD_UNPACK(iq[n], i, q);
+        iq[n] = QUAD_PACK(i >> 3, q >> 3);
+    }
 }
 
-int16_t usb_demod(uint32_t iq) {
-    return 0;
+void cw_demod(void *state, const uint32_t *iq, int16_t *audio, int count) {
+    memset(audio, 0, count * sizeof(int16_t));
 }
 
-uint32_t lsb_mod(int16_t audio) {
-    return 0;
+struct ssb_state {
+    struct ssb_modulator mod;
+    struct ssb_demodulator demod;
+};
+
+static struct ssb_state usb, lsb;
+
+void usb_reset(void *state) {
+    struct ssb_state *s = (struct ssb_state *)state;
+    ssb_modulator_init(&s->mod, 0);
+    ssb_demodulator_init(&s->demod, 0);
 }
 
-int16_t lsb_demod(uint32_t iq) {
-    return 0;
+void lsb_reset(void *state) {
+    struct ssb_state *s = (struct ssb_state *)state;
+    ssb_modulator_init(&s->mod, 1);
+    ssb_demodulator_init(&s->demod, 1);
+}
+
+void ssb_mod(void *state, const int16_t *audio, uint32_t *iq, int count) {
+    struct ssb_state *s = (struct ssb_state *)state;
+    ssb_mod_block(&s->mod, audio, iq, count);
+}
+
+void ssb_demod(void *state, const uint32_t *iq, int16_t *audio, int count) {
+    struct ssb_state *s = (struct ssb_state *)state;
+    ssb_demod_block(&s->demod, iq, audio, count);
 }
 
 static const struct modulators_list modulators_list[] = {
-    { "AM", am_mod, am_demod },
-    { "FM", fm_mod, fm_demod },
-    { "CW", cw_mod, cw_demod },
-    { "USB", usb_mod, usb_demod },
-    { "LSB", lsb_mod, lsb_demod },
+    { "AM", am_mod, am_demod, 0, 0 },
+    { "FM", fm_mod, fm_demod, fm_reset, &fm },
+    { "CW", cw_mod, cw_demod, cw_reset, &cw },
+    { "USB", ssb_mod, ssb_demod, usb_reset, &usb },
+    { "LSB", ssb_mod, ssb_demod, lsb_reset, &lsb },
     { 0, 0},
 };
 
 
+// Call after the synthesizer has been tuned to frequency.
+static void modem_lo_tuned(float frequency) {
+    lo_frequency = frequency;
+    mixer_set_frequency(&tx_mixer, 0, RF_SAMPLE_RATE);
+    mixer_set_frequency(&rx_mixer, 0, RF_SAMPLE_RATE);
+}
+
+static int modem_pipe(int fds[2]) {
+    if (pipe(fds) < 0)
+        return -1;
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+static void modem_wake(int fd) {
+    // A full pipe already has the other side on its way.
+    char wake = 0;
+    if (write(fd, &wake, 1) < 0 && errno != EAGAIN)
+        perror("modem wake");
+}
+
+static void modem_drain_pipe(int fd) {
+    char drain[64];
+    while (read(fd, drain, sizeof(drain)) > 0)
+        ;
+}
+
+static void modem_post(enum modem_command_type type, float frequency,
+        const struct modulators_list *mode) {
+    struct modem_command c;
+    c.type = type;
+    c.frequency = frequency;
+    c.mode = mode;
+    if (commands.write(&c, 1) != 1) {
+        std::cerr << "modem command queue full" << std::endl;
+        return;
+    }
+    modem_wake(command_pipe[1]);
+}
+
+static void *modem_thread(void *);
+
+// The notify pipe is read until it's empty, so it can be edge triggered.
+class modem_poll_handler : public poll_handler {
+public:
+    void ready(int fd, unsigned int revents) {
+        modem_drain();
+    }
+};
+
+static modem_poll_handler notify_handler;
+
 void *modem_init() {
     //std::cerr << "Opening the modem";
     whitebox = &wb;
@@ -113,8 +324,13 @@ void *modem_init() {
     std::cerr << "Sensitivity" << SENSITIVITY << std::endl;
     whitebox_init(whitebox);
     whitebox->frequency = 145e6;
-    fcw = freq_to_fcw(400, RF_SAMPLE_RATE);
-    phase = 0;
+    requested_frequency = whitebox->frequency;
+    modem_lo_tuned(whitebox->frequency);
+    cw.fcw = freq_to_fcw(400, RF_SAMPLE_RATE);
+    cw.phase = 0;
+    fm_reset(&fm);
+    usb_reset(&usb);
+    lsb_reset(&lsb);
     if (whitebox_open(whitebox, "/dev/whitebox", O_RDWR | O_NONBLOCK,
             RF_SAMPLE_RATE) < 0) {
         std::cerr << "Error: Couldn't open the whitebox" << std::endl;
@@ -124,15 +340,40 @@ void *modem_init() {
         std::cerr << "Error: couldn't mmap the whitebox" << std::endl;
         return NULL;
     }
+    if (modem_pipe(command_pipe) < 0 || modem_pipe(notify_pipe) < 0) {
+        perror("modem pipe");
+        return NULL;
+    }
     modem_set_mode("AM");
-    whitebox_tx_set_latency(whitebox, 10);
+    whitebox_tx_set_latency(whitebox, tx_latency_ms);
+    whitebox_rx_set_latency(whitebox, MODEM_RX_LATENCY_MS);
+    if (tx_pacing > 0) {
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (timer_fd < 0)
+            perror("modem timer");
+    }
+    if (pthread_create(&thread, NULL, modem_thread, NULL) != 0) {
+        std::cerr << "Error: couldn't start the modem thread" << std::endl;
+        return NULL;
+    }
+    thread_running = true;
+    poll_start_fd(notify_pipe[0], POLLIN, &notify_handler, true);
     return whitebox;
 }
 
 void modem_close(void *data) {
-    if (started) {
-        poll_end_fd(whitebox->fd);
+    if (thread_running) {
+        poll_end_fd(notify_pipe[0]);
+        modem_post(MODEM_QUIT, 0, 0);
+        pthread_join(thread, NULL);
+        thread_running = false;
     }
+    for (int i = 0; i < 2; ++i) {
+        close(command_pipe[i]);
+        close(notify_pipe[i]);
+    }
+    if (timer_fd >= 0)
+        close(timer_fd);
     whitebox_munmap(whitebox);
     whitebox_close(whitebox);
     //free(whitebox);
@@ -149,48 +390,64 @@ int modem_descriptors(void *data, struct pollfd *ufds, int count) {
 void modem_handler(void *data, struct pollfd *ufds, int count) {
 }
 
-void modem_transmit() {
-#if 1
+void modem_set_tx_pacing(int latency_ms, int wakeups) {
+    if (latency_ms > 0)
+        tx_latency_ms = latency_ms;
+    if (wakeups >= 0)
+        tx_pacing = wakeups;
+}
+
+void modem_set_thread(int priority, int cpu) {
+    if (priority >= 0)
+        thread_priority = priority;
+    thread_cpu = cpu;
+}
+
+/*
+ * Everything from here to modem_thread() runs on the modem thread.
+ */
+
+static void modem_pacing(bool on) {
+    struct itimerspec its;
+    long interval;
+
+    if (timer_fd < 0)
+        return;
+    memset(&its, 0, sizeof(its));
+    if (on) {
+        interval = tx_latency_ms * 1000000L / tx_pacing;
+        its.it_value.tv_sec = its.it_interval.tv_sec = interval / 1000000000L;
+        its.it_value.tv_nsec = its.it_interval.tv_nsec = interval % 1000000000L;
+    }
+    if (timerfd_settime(timer_fd, 0, &its, NULL) < 0)
+        perror("modem pacing");
+}
+
+static void modem_start_transmit() {
     rxing = false;
     if (whitebox_tx(whitebox, whitebox->frequency) < 0) {
         std::cerr << "Transmit start failed!" << std::endl;
         //exit(-1);
     }
+    modem_lo_tuned(whitebox->frequency);
     txing = true;
-
-    if (!started) {
-        std::cerr << "Transmit start (first time)" << std::endl;
-        poll_start_fd(0, whitebox->fd, POLLOUT | POLLERR, WHITEBOX_FD);
-        started = true;
-    } else {
-        std::cerr << "Transmit start" << std::endl;
-        poll_change_fd(whitebox->fd, POLLOUT | POLLERR);
-    }
-#endif
+    modem_pacing(true);
+    std::cerr << "Transmit start" << std::endl;
 }
 
-void modem_receive() {
-#if 1
+static void modem_start_receive() {
     txing = false;
+    modem_pacing(false);
     if (whitebox_rx(whitebox, whitebox->frequency) < 0) {
         std::cerr << "Receive start failed!" << std::endl;
         //exit(-1);
     }
-
-    if (!started) {
-        std::cerr << "Receive started (first time)" << std::endl;
-        poll_start_fd(0, whitebox->fd, POLLIN | POLLERR, WHITEBOX_FD);
-        started = true;
-    } else {
-        std::cerr << "Receive started" << std::endl;
-        poll_change_fd(whitebox->fd, POLLIN | POLLERR);
-    }
+    modem_lo_tuned(whitebox->frequency);
+    std::cerr << "Receive started" << std::endl;
     rxing = true;
-#endif
 }
 
-void modem_standby() {
-#if 1
+static void modem_enter_standby() {
     if (txing) {
         if (whitebox_tx_standby(whitebox) < 0) {
             std::cerr << "Tx standby failed!" << std::endl;
@@ -203,54 +460,110 @@ void modem_standby() {
             //exit(-1);
         }
     }
-    if (started) {
-        //poll_change_fd(whitebox->fd, POLLERR);
-        poll_end_fd(whitebox->fd);
-        started = false;
-    }
     txing = rxing = false;
-#endif
+    modem_pacing(false);
+}
+
+static void modem_tune(float frequency) {
+    if (whitebox->frequency != frequency) {
+        std::cerr << "new frequency " << frequency << std::endl;
+        whitebox->frequency = frequency;
+        float offset = frequency - lo_frequency;
+        if (offset > tuning_window || offset < -tuning_window) {
+            if (txing) whitebox_tx_fine_tune(whitebox, frequency);
+            if (rxing) whitebox_rx_fine_tune(whitebox, frequency);
+            if (txing || rxing) {
+                modem_lo_tuned(frequency);
+                return;
+            }
+            // Idle; the next transmit or receive tunes the synthesizer.
+        }
+        // The transmit mixer shifts up onto the new frequency, the receive
+        // mixer brings it back down to baseband.
+        mixer_set_frequency(&tx_mixer, offset, RF_SAMPLE_RATE);
+        mixer_set_frequency(&rx_mixer, -offset, RF_SAMPLE_RATE);
+    }
 }
 
-void modem_write() {
+// Modulates up to max samples into the transmit buffer, returning how
+// many went.
+static unsigned long modem_write(unsigned long max) {
     if (!txing) {
         std::cerr << "sending, but not txing?" << std::endl;
         //exit(-1);
     }
     unsigned long dest, count;
+    int16_t audio[MODEM_BLOCK_SIZE];
     count = ioctl(whitebox->fd, W_MMAP_WRITE, &dest) >> 2;
-    count = count < 1024 ? count : 1024;
+    count = count < MODEM_BLOCK_SIZE ? count : MODEM_BLOCK_SIZE;
+    count = count < max ? count : max;
     if (count == 0) {
-        return;
+        return 0;
     }
-    for (int i = 0; i < count; i++) {
-        int16_t audio_sample = source();
-        //std::cerr << ' ' << audio_sample;
-        //fprintf(stderr, " %d", audio_sample);
-        ((uint32_t*)dest)[i] = current_mod(audio_sample);
+    // Modulate straight into the driver's mmap'd buffer.
+    unsigned long got = tx_audio.read(audio, count);
+    if (got < count) {
+        memset(&audio[got], 0, (count - got) * sizeof(int16_t));
+        tx_starved += count - got;
     }
+    current->mod(current->state, audio, (uint32_t*)dest, count);
+    mixer_block(&tx_mixer, (uint32_t*)dest, (uint32_t*)dest, count);
     int ret = write(whitebox->fd, 0, count << 2);
     if (ret != count << 2) {
         std::cerr << "Write error" << std::endl;
         //exit(-1);
         //modem_recover();
+        return 0;
+    }
+    // The I/O thread tops tx_audio back up.
+    modem_wake(notify_pipe[1]);
+    return count;
+}
+
+// A pacing timer tick: note how full the transmit buffer still is, then
+// top it back up to the latency target.
+static void modem_paced_write() {
+    uint64_t expirations;
+    long target, fill;
+    int bucket;
+
+    if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+    target = (long)RF_SAMPLE_RATE * tx_latency_ms / 1000;
+    fill = whitebox_tx_fill(whitebox);
+    if (fill < 0 || target <= 0)
+        return;
+    fill >>= 2;
+    bucket = fill * (MODEM_FILL_BUCKETS - 1) / target;
+    fill_histogram[bucket < MODEM_FILL_BUCKETS ? bucket : MODEM_FILL_BUCKETS - 1]++;
+    while (fill < target) {
+        unsigned long n = modem_write(target - fill);
+        if (n == 0)
+            break;
+        fill += n;
     }
 }
 
-void modem_read() {
+static void modem_read() {
     if (!rxing) {
         std::cerr << "reading, but not rxing?" << std::endl;
         //exit(-1);
     }
     //std::cerr << "Modem read" << std::endl;
     unsigned long src, count;
+    int16_t audio[MODEM_BLOCK_SIZE];
+    uint32_t iq[MODEM_BLOCK_SIZE];
     count = ioctl(whitebox->fd, W_MMAP_READ, &src) >> 2;
-    count = count < 1024 ? count : 1024;
+    count = count < MODEM_READ_BATCH ? count : MODEM_READ_BATCH;
     if (count == 0) return;
-    for (int i = 0; i < count; i++) {
-        //int16_t audio_sample = source();
-        //((uint32_t*)dest)[i] = current_mod(audio_sample);
-        sink(current_demod(((uint32_t*)src)[i]));
+    // Work through everything that is mapped, then release it in one go.
+    // Whatever the I/O thread hasn't taken yet shows up as ring overflow.
+    for (unsigned long done = 0; done < count; done += MODEM_BLOCK_SIZE) {
+        int n = count - done < MODEM_BLOCK_SIZE ? count - done : MODEM_BLOCK_SIZE;
+        mixer_block(&rx_mixer, (uint32_t*)src + done, iq, n);
+        current->demod(current->state, iq, audio, n);
+        rx_audio.write(audio, n);
+        rx_iq.write(iq, n);
     }
     int ret = read(whitebox->fd, 0, count << 2);
     if (ret != count << 2) {
@@ -258,10 +571,15 @@ void modem_read() {
         //exit(-1);
         //modem_recover();
     }
+    modem_wake(notify_pipe[1]);
 }
 
-void modem_recover() {
+static void modem_recover() {
     std::cerr << "recover" << std::endl;
+    if (rxing)
+        rx_overruns++;
+    if (txing)
+        tx_underruns++;
     whitebox_reset(whitebox);
     if (txing) {
         if (whitebox_tx(whitebox, whitebox->frequency) < 0) {
@@ -276,19 +594,283 @@ void modem_recover() {
         }
     } else {
     }
+    modem_lo_tuned(whitebox->frequency);
+}
+
+static void modem_run_scan() {
+    int count, dwell_ms;
+    bool resume = rxing;
+
+    pthread_mutex_lock(&scan_lock);
+    count = scan_request_count;
+    dwell_ms = scan_dwell_ms;
+    for (int i = 0; i < count; ++i)
+        scan_channels[i].frequency = scan_request[i];
+    pthread_mutex_unlock(&scan_lock);
+
+    if (txing) {
+        std::cerr << "scan dropped while transmitting" << std::endl;
+        return;
+    }
+    rxing = false;
+    float rate = whitebox_scan(whitebox, scan_channels, count,
+            (unsigned long)RF_SAMPLE_RATE * dwell_ms / 1000);
+    if (rate < 0) {
+        perror("scan");
+    } else {
+        std::cerr << "scanned " << count << " channels, " << rate
+            << " per second" << std::endl;
+        pthread_mutex_lock(&scan_lock);
+        memcpy(scan_results, scan_channels, count * sizeof(scan_channels[0]));
+        scan_result_count = count;
+        scan_rate = rate;
+        pthread_mutex_unlock(&scan_lock);
+        ++scans_finished;
+        modem_wake(notify_pipe[1]);
+    }
+
+    // The scan leaves the synthesizer wherever it finished.
+    if (resume)
+        modem_start_receive();
+    else
+        whitebox_rx_standby(whitebox);
+}
+
+// Applies everything the I/O thread has posted.  Returns false when it's
+// time to stop.
+static bool modem_commands() {
+    struct modem_command c;
+
+    modem_drain_pipe(command_pipe[0]);
+    while (commands.fill() > 0) {
+        commands.read(&c, 1);
+        switch (c.type) {
+            case MODEM_TRANSMIT:
+                modem_start_transmit();
+                break;
+            case MODEM_RECEIVE:
+                modem_start_receive();
+                break;
+            case MODEM_STANDBY:
+                modem_enter_standby();
+                break;
+            case MODEM_FREQUENCY:
+                modem_tune(c.frequency);
+                break;
+            case MODEM_MODE:
+                if (current != c.mode && c.mode->reset)
+                    c.mode->reset(c.mode->state);
+                current = c.mode;
+                break;
+            case MODEM_SCAN:
+                modem_run_scan();
+                break;
+            case MODEM_QUIT:
+                modem_enter_standby();
+                return false;
+        }
+    }
+    return true;
+}
+
+static void modem_thread_schedule() {
+    if (thread_priority > 0) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = thread_priority;
+        if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)
+            std::cerr << "Warning: modem thread isn't real-time" << std::endl;
+    }
+#ifdef CPU_SET
+    if (thread_cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(thread_cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+            perror("modem thread affinity");
+    }
+#endif
+}
+
+static void *modem_thread(void *) {
+    modem_thread_schedule();
+    for (;;) {
+        struct pollfd fds[3];
+        int n = 1;
+        bool paced = txing && tx_pacing > 0 && timer_fd >= 0;
+        fds[0].fd = command_pipe[0];
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        if (txing || rxing) {
+            // Paced transmits only need to hear about errors.
+            fds[1].fd = whitebox->fd;
+            fds[1].events = paced ? POLLERR
+                : (txing ? POLLOUT : POLLIN) | POLLERR;
+            fds[1].revents = 0;
+            n = 2;
+        }
+        if (paced) {
+            fds[2].fd = timer_fd;
+            fds[2].events = POLLIN;
+            fds[2].revents = 0;
+            n = 3;
+        }
+        if (poll(fds, n, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("modem poll");
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            if (!modem_commands())
+                break;
+            // The whitebox may be doing something else now; poll again.
+            continue;
+        }
+        if (n >= 2) {
+            if (fds[1].revents & POLLOUT)
+                modem_write(MODEM_BLOCK_SIZE);
+            if (fds[1].revents & POLLIN)
+                modem_read();
+            if (fds[1].revents & POLLERR)
+                modem_recover();
+        }
+        if (n == 3 && (fds[2].revents & POLLIN))
+            modem_paced_write();
+    }
+    return NULL;
+}
+
+/*
+ * The rest is called from the I/O thread.
+ */
+
+// Whether the I/O thread should keep the transmitter's audio coming.
+static bool tx_requested = false;
+
+static void modem_fill_tx() {
+    if (!tx_requested)
+        return;
+    for (;;) {
+        spsc_span<int16_t> space = tx_audio.write_block();
+        if (space.length == 0)
+            break;
+        // Only what the source has; modem_write() pads if it runs short.
+        int got = source(space.data, space.length);
+        if (got <= 0)
+            break;
+        tx_audio.write_commit(got);
+        if ((size_t)got < space.length)
+            break;
+    }
+}
+
+void modem_transmit() {
+    tx_requested = true;
+    modem_fill_tx();
+    modem_post(MODEM_TRANSMIT, 0, 0);
+}
+
+void modem_receive() {
+    tx_requested = false;
+    modem_post(MODEM_RECEIVE, 0, 0);
+}
+
+void modem_standby() {
+    tx_requested = false;
+    modem_post(MODEM_STANDBY, 0, 0);
+}
+
+void modem_drain() {
+    modem_drain_pipe(notify_pipe[0]);
+    // Hand it on a block at a time, as it was demodulated.
+    for (;;) {
+        spsc_span<const int16_t> audio = rx_audio.read_block();
+        if (audio.length == 0)
+            break;
+        if (audio.length > MODEM_BLOCK_SIZE)
+            audio.length = MODEM_BLOCK_SIZE;
+        sink(audio.data, audio.length);
+        radio_audio_out(audio.data, audio.length);
+        rx_audio.read_commit(audio.length);
+    }
+    for (;;) {
+        spsc_span<const uint32_t> iq = rx_iq.read_block();
+        if (iq.length == 0)
+            break;
+        if (iq.length > MODEM_BLOCK_SIZE)
+            iq.length = MODEM_BLOCK_SIZE;
+        radio_iq_in(iq.data, iq.length);
+        rx_iq.read_commit(iq.length);
+    }
+    if (scans_reported != scans_finished) {
+        scans_reported = scans_finished;
+        radio_scan_done();
+    }
+    modem_fill_tx();
+}
+
+unsigned int modem_get_overruns() {
+    return rx_overruns;
+}
+
+unsigned int modem_get_underruns() {
+    return tx_underruns;
+}
+
+unsigned long modem_get_starved() {
+    return tx_starved;
+}
+
+void modem_get_fill_histogram(unsigned int *counts) {
+    for (int i = 0; i < MODEM_FILL_BUCKETS; ++i)
+        counts[i] = fill_histogram[i];
+}
+
+unsigned long modem_get_backlog() {
+    return rx_audio.fill();
+}
+
+unsigned long modem_get_rx_dropped() {
+    return rx_audio.overflow_count();
 }
 
 float modem_get_frequency() {
-    return whitebox->frequency;
+    return requested_frequency;
 }
 
 void modem_set_frequency(float frequency) {
-    if (whitebox->frequency != frequency) {
-        std::cerr << "new frequency " << frequency << std::endl;
-        whitebox->frequency = frequency;
-        if (txing) whitebox_tx_fine_tune(whitebox, frequency);
-        if (rxing) whitebox_rx_fine_tune(whitebox, frequency);
-    }
+    requested_frequency = frequency;
+    modem_post(MODEM_FREQUENCY, frequency, 0);
+}
+
+void modem_set_tuning_window(float window) {
+    tuning_window = window;
+}
+
+void modem_scan(const float *frequencies, int count, int dwell_ms) {
+    if (count <= 0 || dwell_ms <= 0)
+        return;
+    if (count > MODEM_SCAN_MAX)
+        count = MODEM_SCAN_MAX;
+    pthread_mutex_lock(&scan_lock);
+    memcpy(scan_request, frequencies, count * sizeof(float));
+    scan_request_count = count;
+    scan_dwell_ms = dwell_ms;
+    pthread_mutex_unlock(&scan_lock);
+    modem_post(MODEM_SCAN, 0, 0);
+}
+
+int modem_get_scan(struct whitebox_scan_channel *channels, int max,
+        float *rate) {
+    int count;
+    pthread_mutex_lock(&scan_lock);
+    count = scan_result_count < max ? scan_result_count : max;
+    memcpy(channels, scan_results, count * sizeof(scan_results[0]));
+    if (rate)
+        *rate = scan_rate;
+    pthread_mutex_unlock(&scan_lock);
+    return count;
 }
 
 const char* modem_get_mode() {
@@ -303,8 +885,7 @@ void modem_set_mode(const char* new_mode) {
     }
     for (int i = 0; modulators_list[i].name; ++i) {
         if (strcmp(modulators_list[i].name, mode) == 0) {
-            current_mod = modulators_list[i].mod;
-            current_demod = modulators_list[i].demod;
+            modem_post(MODEM_MODE, 0, &modulators_list[i]);
             return;
         }
     }
@@ -319,4 +900,3 @@ struct resource_ops modem_ops = {
     modem_descriptors,
     modem_handler,
 };
-
@@ -3,6 +3,10 @@
 
 #include "resources.h"
 
+// Sample rate of the I/Q stream exchanged with the whitebox, and therefore
+// of the audio produced by source() and consumed by sink().
+#define RF_SAMPLE_RATE 50000
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -13,17 +17,68 @@ void modem_transmit();
 void modem_receive();
 void modem_standby();
 
-void modem_service_fd(short revents);
-void modem_write();
-void modem_read();
-void modem_recover();
+// The modem runs its own thread, at this SCHED_FIFO priority (0 leaves it
+// at the default policy, negative keeps the built in priority) and pinned
+// to this CPU (-1 for any).  Call before the modem is opened.
+void modem_set_thread(int priority, int cpu);
+
+// Sets the transmit buffer latency target, and how many times per latency
+// period a timer wakes the modem to fill back up to it.  Zero wakeups
+// leaves the modem writing on every POLLOUT instead.  Negative values keep
+// the current setting.  Call before the modem is opened.
+void modem_set_tx_pacing(int latency_ms, int wakeups);
+
+// Paced transmit wakeups by how full they found the buffer, in eighths of
+// the latency target; the last bucket is at or above it.
+#define MODEM_FILL_BUCKETS 9
+void modem_get_fill_histogram(unsigned int *counts);
+
+// Called by the I/O thread when the modem thread has receive results for
+// it, or has taken transmit audio.  Hands received audio to sink() and the
+// radio, refills the transmit audio from source(), and tells the radio when
+// a scan has finished.
+void modem_drain();
+
+// Receive overruns since the modem was opened.
+unsigned int modem_get_overruns();
+
+// Transmit underruns since the modem was opened.
+unsigned int modem_get_underruns();
+
+// Transmit audio samples padded with silence because the source hadn't
+// supplied them in time.
+unsigned long modem_get_starved();
+
+// Received samples waiting for the I/O thread, a snapshot.
+unsigned long modem_get_backlog();
+
+// Received samples dropped because the I/O thread fell too far behind to
+// take them, since the modem was opened.
+unsigned long modem_get_rx_dropped();
 
 float modem_get_frequency();
 void modem_set_frequency(float frequency);
 
+// Largest offset from the synthesizer, in Hz, that modem_set_frequency
+// makes digitally.  Zero retunes the synthesizer for every change.
+void modem_set_tuning_window(float window);
+
 const char* modem_get_mode();
 void modem_set_mode(const char* new_mode);
 
+// Sweeps the receiver across up to MODEM_SCAN_MAX frequencies, measuring
+// the power on each over dwell_ms.  The modem thread does nothing else
+// meanwhile; a receive in progress picks up again afterwards, and a scan
+// asked for while transmitting is dropped.
+#define MODEM_SCAN_MAX 256
+struct whitebox_scan_channel;
+void modem_scan(const float *frequencies, int count, int dwell_ms);
+
+// Copies out the last completed scan, returning how many channels it
+// covered, and how many it got through a second if rate isn't NULL.
+int modem_get_scan(struct whitebox_scan_channel *channels, int max,
+        float *rate);
+
 // modulator_write
 // demodulator_read
 
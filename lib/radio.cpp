@@ -7,10 +7,14 @@
 #include <openssl/err.h>
 #include <poll.h>
 #include <sys/time.h>
-#include "cJSON.h"
+#include <algorithm>
+#include <vector>
+#include "dsp.h"
+#include "json_stream.h"
 #include "modem.h"
 #include "radio.h"
 #include "resources.h"
+#include "whitebox.h"
 
 // Add members to radio_context as you wish.
 class radio_context {
@@ -24,8 +28,79 @@ public:
     radio_context(client_context * c) : client(c) {
     };
     ~radio_context();
+
+    inline client_context * get_client() const { return client; }
 };
 
+// Receive audio goes to every client that has asked to receive, resampled
+// to the rate katena.js plays (netSampleRate), in frames of
+// RX_FRAME_SAMPLES.  Each frame is built once and shared by all of them.
+// Samples go out in Q12, as katena.js reads them, so the demodulators'
+// full scale output is shifted down by RX_FRAME_SHIFT on the way in.
+#define NET_SAMPLE_RATE		8192
+#define RX_FRAME_SAMPLES	512
+#define RX_FRAME_TYPE		1
+#define RX_FRAME_SHIFT		3
+
+static std::vector<radio_context *>	listeners;
+static struct resampler		rx_resampler;
+static int16_t			rx_frame[RX_FRAME_SAMPLES];
+static int			rx_frame_fill = 0;
+static unsigned int		rx_frames_dropped = 0;
+
+static void
+receive_stop(radio_context * radio)
+{
+  listeners.erase(
+   std::remove(listeners.begin(), listeners.end(), radio),
+   listeners.end());
+}
+
+void
+radio_audio_out(const int16_t * audio, int count)
+{
+  if ( listeners.empty() )
+    return;
+
+  while ( count > 0 ) {
+    int consumed;
+    rx_frame_fill += resample16(
+     &rx_resampler,
+     audio,
+     count,
+     &rx_frame[rx_frame_fill],
+     RX_FRAME_SAMPLES - rx_frame_fill,
+     &consumed);
+    audio += consumed;
+    count -= consumed;
+
+    if ( rx_frame_fill < RX_FRAME_SAMPLES )
+      continue;
+    rx_frame_fill = 0;
+
+    // A client that can't keep up loses whole frames rather than queueing
+    // without bound, and if none can keep up the frame isn't built at all.
+    WriteBuffer * buffer = 0;
+    for ( size_t i = 0; i < listeners.size(); i++ ) {
+      client_context * const client = listeners[i]->get_client();
+      if ( server_congested(client) ) {
+        rx_frames_dropped++;
+        continue;
+      }
+      if ( !buffer ) {
+        buffer = new WriteBuffer(sizeof(rx_frame), RX_FRAME_TYPE);
+        int16_t * const out = (int16_t *)buffer->data();
+        for ( int n = 0; n < RX_FRAME_SAMPLES; n++ )
+          out[n] = rx_frame[n] >> RX_FRAME_SHIFT;
+      }
+      buffer->hold();
+      server_data_out(client, buffer);
+    }
+    if ( buffer )
+      buffer->release();
+  }
+}
+
 void
 radio_data_in(
  radio_context *	/* radio */,
@@ -36,51 +111,177 @@ radio_data_in(
 {
     const int16_t *audio_data = (int16_t *)data;
 
-    // TODO: do this as a block of data
-    for (int i = 0; i < length / 2; ++i) {
-        //std::cerr << ' ' << audio_data[i];
-        //fprintf(stderr, " %d", audio_data[i]);
+    sink(audio_data, length / 2);
+}
+
+// Spectrum frames carry the I/Q sample rate as a uint32, then one byte per
+// bin as written by spectrum_read().
+#define SPECTRUM_FRAME_TYPE	2
+#define SPECTRUM_AVERAGES	4
+#define SPECTRUM_MAX_QUEUED	4
 
-        sink(audio_data[i]);
-    }
-    //std::cerr << std::endl;
-    //fprintf(stderr, "\n");
+static struct spectrum	spectrum;
+static bool		spectrum_ready = false;
+static long		spectrum_interval = 100000;  // Microseconds.
+static struct timeval	spectrum_due;
+
+int
+radio_spectrum_configure(int bins, int rate)
+{
+  int order = 0;
+
+  while ( (1 << order) < bins )
+    order++;
+  if ( (1 << order) != bins || spectrum_init(&spectrum, order) < 0 )
+    return -1;
+  spectrum_ready = rate > 0;
+  spectrum_interval = rate > 0 ? 1000000 / rate : 0;
+  return 0;
+}
+
+void
+radio_iq_in(const uint32_t * iq, int count)
+{
+  static uint8_t	frame[sizeof(uint32_t) + (1 << FFT_MAX_ORDER)];
+  struct timeval	now;
+
+  if ( !spectrum_ready )
+    return;
+
+  // Never more than one transform per call, nor more than we will send.
+  if ( spectrum.count < SPECTRUM_AVERAGES )
+    spectrum_push(&spectrum, iq, count);
+
+  gettimeofday(&now, 0);
+  if ( timercmp(&now, &spectrum_due, <) )
+    return;
+  spectrum_due.tv_sec = now.tv_sec;
+  spectrum_due.tv_usec = now.tv_usec + spectrum_interval;
+  spectrum_due.tv_sec += spectrum_due.tv_usec / 1000000;
+  spectrum_due.tv_usec %= 1000000;
+
+  if ( spectrum_read(&spectrum, &frame[sizeof(uint32_t)]) == 0 )
+    return;
+  *(uint32_t *)frame = RF_SAMPLE_RATE;
+  server_broadcast(
+   SPECTRUM_FRAME_TYPE,
+   frame,
+   sizeof(uint32_t) + (1 << spectrum.order),
+   SPECTRUM_MAX_QUEUED);
 }
 
 void
 radio_end(radio_context * radio, const client_info *)
 {
-  modem_standby();
+  receive_stop(radio);
+  // Anyone still listening keeps the receiver.
+  if ( listeners.empty() )
+    modem_standby();
+  else
+    modem_receive();
   std::cerr << "Close client." << std::endl;
   delete radio;
 }
 
+// The last scan, copied out of the modem once when it finishes rather than
+// for every status.
+static whitebox_scan_channel_t	scan_table[MODEM_SCAN_MAX];
+static int			scan_table_count = 0;
+static float			scan_table_rate = 0;
+
 void
-radio_get_status(radio_context *, const client_info *, cJSON * json)
+radio_scan_done()
 {
-    cJSON_AddNumberToObject(json, "frequency", modem_get_frequency());
-    cJSON_AddStringToObject(json, "mode", modem_get_mode());
+  scan_table_count = modem_get_scan(scan_table, MODEM_SCAN_MAX, &scan_table_rate);
+  server_status_changed();
+}
+
+static void
+scan_status(json_writer * json)
+{
+  if ( scan_table_count == 0 )
+    return;
+
+  json_object_begin(json, "scan");
+  json_write_number(json, "rate", scan_table_rate);
+  json_array_begin(json, "channels");
+  for ( int i = 0; i < scan_table_count; i++ ) {
+    const whitebox_scan_channel_t * c = &scan_table[i];
+
+    // An unlocked channel's RSSI is -HUGE_VAL, which goes out as null.
+    json_object_begin(json, 0);
+    json_write_number(json, "frequency", c->frequency);
+    json_write_number(json, "rssi", floorf(c->rssi * 10 + 0.5f) / 10);
+    json_write_long(json, "lock_us", c->lock_us);
+    json_object_end(json);
+  }
+  json_array_end(json);
+  json_object_end(json);
 }
 
 void
-radio_receive(radio_context *, const client_info *)
+radio_get_status(radio_context *, const client_info *, json_writer * json)
 {
-    modem_receive();
+    json_write_number(json, "frequency", modem_get_frequency());
+    json_write_string(json, "mode", modem_get_mode());
+    json_write_long(json, "overruns", modem_get_overruns());
+    json_write_long(json, "underruns", modem_get_underruns());
+    json_write_long(json, "tx_starved", modem_get_starved());
+    json_write_long(json, "backlog", modem_get_backlog());
+    json_write_long(json, "rx_dropped", modem_get_rx_dropped());
+
+    unsigned int fill[MODEM_FILL_BUCKETS];
+    int fill_counts[MODEM_FILL_BUCKETS];
+    modem_get_fill_histogram(fill);
+    for ( int i = 0; i < MODEM_FILL_BUCKETS; i++ )
+      fill_counts[i] = fill[i];
+    json_write_int_array(json, "fill", fill_counts, MODEM_FILL_BUCKETS);
+    json_write_long(json, "dropped", rx_frames_dropped);
+    scan_status(json);
 }
 
 void
-radio_set(radio_context *, const client_info *, const cJSON * json)
+radio_receive(radio_context * radio, const client_info *)
 {
-    const cJSON * freq_obj = cJSON_GetObjectItem((cJSON*)json, "frequency");
-    if (freq_obj) {
-        float frequency = freq_obj->valuedouble;
-        modem_set_frequency(frequency);
+    if ( std::find(listeners.begin(), listeners.end(), radio)
+     == listeners.end() ) {
+      if ( listeners.empty() ) {
+        resampler_init(&rx_resampler, RF_SAMPLE_RATE, NET_SAMPLE_RATE);
+        rx_frame_fill = 0;
+      }
+      listeners.push_back(radio);
     }
-    const cJSON * mode_obj = cJSON_GetObjectItem((cJSON*)json, "mode");
-    if (mode_obj) {
-        char* mode = mode_obj->valuestring;
-        modem_set_mode(mode);
+    modem_receive();
+}
+
+void
+radio_set(radio_context *, const client_info *, const radio_settings * settings)
+{
+    if (settings->has_frequency)
+        modem_set_frequency(settings->frequency);
+    if (settings->mode[0])
+        modem_set_mode(settings->mode);
+}
+
+int
+radio_scan(radio_context *, const client_info *, const radio_settings * settings)
+{
+    float	frequencies[MODEM_SCAN_MAX];
+    int		count = 0;
+
+    if ( settings->step <= 0 || settings->dwell < 1
+     || settings->stop < settings->start )
+      return -1;
+
+    // Index from start, so the steps don't accumulate rounding error.
+    for ( ; count < MODEM_SCAN_MAX; count++ ) {
+      const double f = settings->start + count * settings->step;
+      if ( f > settings->stop )
+        break;
+      frequencies[count] = f;
     }
+    modem_scan(frequencies, count, (int)settings->dwell);
+    return 0;
 }
 
 radio_context *
@@ -91,8 +292,9 @@ radio_start(client_context * client, const client_info *)
 }
 
 void
-radio_transmit(radio_context *, const client_info *)
+radio_transmit(radio_context * radio, const client_info *)
 {
+    receive_stop(radio);
     modem_transmit();
 }
 
@@ -2,27 +2,28 @@
 // opaque from the perspective of the radio code.
 struct libwebsocket_context;
 struct client_context;
-struct cJSON;
+struct json_writer;
 
 // This class is known in the radio code and opaque
 // from the perspective of the server code.
 class radio_context;
 
-/* Barf with a spoon, Chris! */
-#define WEBSOCKET_FD 0
-#define WHITEBOX_FD 1
-#define FILE_SOURCE_FD 2
-
+// A frame is immutable once queued, so one buffer can sit in any number
+// of client queues at once.  Each queue holds a reference; the buffer goes
+// back to the pool when the last one is released.  The constructor returns
+// with one reference held.  Buffers are only touched from the I/O thread,
+// so the count needs no locking.
 class WriteBuffer {
 private:
   unsigned char * const	storage;
   unsigned char * const	buf;
-  WriteBuffer *		next;
+  unsigned int		refs;
   const size_t		maxLength;
   size_t		size;
 
   WriteBuffer &		operator =(const WriteBuffer &);
   			WriteBuffer(const WriteBuffer &);
+			~WriteBuffer();
 
   void			too_large();
 
@@ -31,19 +32,50 @@ public:
 
   inline size_t		length() const { return size; }
 
+  inline uint32_t	type() const {
+			  return *(const uint32_t *)(buf - sizeof(uint32_t));
+			}
+
   inline void		length(size_t l) {
 			  if ( l > maxLength )
 			    too_large();
                           size = l;
 			}
 
-  inline void		link(WriteBuffer * that) { next = that; }
-  inline WriteBuffer *	link() const { return next; }
+  inline void		hold() { refs++; }
+  inline void		release() {
+			  if ( --refs == 0 )
+			    delete this;
+			}
 
   			WriteBuffer(size_t length, uint32_t type);
-			~WriteBuffer();
+
+  // Both the object and its storage come from the write buffer pool.
+  static void *		operator new(size_t);
+  static void		operator delete(void *);
 };
 
+// WriteBuffer storage is pooled in size classes.  capacity is how many
+// free buffers each class keeps for reuse, and is allocated up front.
+#define WRITE_BUFFER_CLASSES	3
+#define WRITE_BUFFER_CAPACITY	16
+
+struct write_buffer_stats {
+  size_t		size;		// Largest payload in the class.
+  unsigned int		free;		// Buffers waiting on the free list.
+  unsigned int		in_use;
+  unsigned int		high_water;	// Most in use at once.
+  unsigned long		misses;		// Allocations the free list couldn't meet.
+};
+
+void		write_buffer_pool_configure(unsigned int capacity);
+
+// Fills in one entry per size class.  Payloads larger than every class
+// come from the heap and are counted in oversize.
+void		write_buffer_pool_stats(
+		 write_buffer_stats	stats[WRITE_BUFFER_CLASSES],
+		 unsigned long *	oversize);
+
 class client_info {
 public:
   const char *	path;
@@ -58,17 +90,66 @@ public:
   void		cleanup();
 };
 
-extern void	poll_start_fd(libwebsocket_context *, int fd, int events, int type);
-extern void	poll_change_fd(int fd, int mode);
+// Whatever watches a descriptor in the main loop.  ready() gets the
+// POLL* bits that are set.
+class poll_handler {
+public:
+  virtual void	ready(int fd, unsigned int revents) = 0;
+  virtual	~poll_handler() {}
+};
+
+// Edge triggered handlers are only woken when the fd becomes ready again,
+// so they must read or write until it returns EAGAIN.
+extern void	poll_start_fd(int fd, int events, poll_handler *, bool edge = false);
+extern void	poll_change_fd(int fd, int events);
 extern void	poll_end_fd(int fd);
 
+// The fields of a "set" or "scan" command.  Those not in the command are
+// left at their defaults, which mean "no change".  A scan covers start to
+// stop inclusive in steps of step Hz, dwelling dwell milliseconds on each.
+#define RADIO_MODE_LENGTH	16
+
+struct radio_settings {
+  bool		has_frequency;
+  double	frequency;
+  char		mode[RADIO_MODE_LENGTH];	// Empty if not set.
+  double	start;
+  double	stop;
+  double	step;
+  double	dwell;
+
+		radio_settings() : has_frequency(false), frequency(0),
+		 start(0), stop(0), step(0), dwell(0) {
+		  mode[0] = '\0';
+		}
+};
+
 extern void		radio_end(radio_context *, const client_info *);
-extern void		radio_get_status(radio_context *, const client_info *, cJSON * json);
+
+// Adds the radio's members to the status object being written.
+extern void		radio_get_status(radio_context *, const client_info *, json_writer *);
 extern radio_context *	radio_start(client_context *, const client_info *);
 extern void		radio_receive(radio_context *, const client_info *);
-extern void		radio_set(radio_context *, const client_info *, const cJSON * json);
+
+// Starts a scan.  Returns -1 if the settings don't describe one.  The
+// results show up in the status when it finishes.
+extern int		radio_scan(radio_context *, const client_info *, const radio_settings *);
+
+// Called on the I/O thread when the modem finishes a scan.
+extern void		radio_scan_done();
+extern void		radio_set(radio_context *, const client_info *, const radio_settings *);
 extern void		radio_transmit(radio_context *, const client_info *);
 
+// Demodulated audio from the modem, at RF_SAMPLE_RATE.
+extern void		radio_audio_out(const int16_t * audio, int count);
+
+// Receive I/Q from the modem, for the spectrum display.
+extern void		radio_iq_in(const uint32_t * iq, int count);
+
+// bins is a power of two; a rate of 0 frames per second turns the
+// spectrum off. Returns -1 if bins is out of range.
+extern int		radio_spectrum_configure(int bins, int rate);
+
 extern void		radio_data_in(
  radio_context *	radio,
  const client_info *	info,
@@ -78,9 +159,51 @@ extern void		radio_data_in(
 
 void		server_end(libwebsocket_context *);
 
+// Queues buffer to the client, taking over one reference to it.
 void		server_data_out(
                  client_context *	opaque,
                  WriteBuffer *		buffer);
 
-void		server_service_fd(libwebsocket_context *, pollfd * pfd);
+// Number of buffers queued to the client and not yet written.
+unsigned int	server_queued(client_context *);
+
+// Each client queues at most depth buffers.  What happens to a buffer
+// queued past that depends on its type's policy:
+//   SEND_DROP_NEWEST   the new buffer is dropped.
+//   SEND_DROP_OLDEST   the oldest queued buffer of that type makes room.
+//   SEND_COALESCE      a new buffer replaces any of its type still queued,
+//                      full or not, since only the latest matters.
+// By default status (type 0) coalesces, receive audio (type 1) drops the
+// oldest, and everything else drops the newest.
+#define SERVER_QUEUE_DEPTH	16
+#define SERVER_FRAME_TYPES	4
+
+enum send_policy {
+  SEND_DROP_NEWEST,
+  SEND_DROP_OLDEST,
+  SEND_COALESCE
+};
+
+void		server_set_queue_depth(unsigned int depth);
+void		server_set_send_policy(uint32_t type, send_policy policy);
+
+// True once the client's queue is half full; producers should skip or
+// shrink what they send it until it drains.
+bool		server_congested(client_context *);
+
+// Queue data to every open client that has fewer than max_queued buffers
+// still waiting to go out.  It is copied once and shared by all of them.
+void		server_broadcast(
+		 uint32_t		type,
+		 const void *		data,
+		 size_t			length,
+		 unsigned int		max_queued);
+
+// The status every client sees has changed.  It is encoded once and
+// broadcast, at most once per STATUS_INTERVAL_MS however often this is
+// called; a change inside the interval goes out when it ends.
+#define STATUS_INTERVAL_MS	100
+
+void		server_status_changed();
+
 libwebsocket_context * server_start(const char * device, int port, bool use_ssl);
@@ -0,0 +1,768 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+
+#include "reactor.h"
+
+#define REACTOR_MAX_EVENTS      16
+#define REACTOR_BUFFER_MIN_CAPACITY   1024
+#define WHITEBOX_SINK_FLUSH_MS  1000
+
+/*
+ * reactor_buffer
+ */
+
+struct reactor_buffer *reactor_buffer_new(void)
+{
+    return calloc(1, sizeof(struct reactor_buffer));
+}
+
+void reactor_buffer_free(struct reactor_buffer *buf)
+{
+    if (!buf)
+        return;
+    free(buf->data);
+    free(buf);
+}
+
+size_t reactor_buffer_get_length(const struct reactor_buffer *buf)
+{
+    return buf->length;
+}
+
+int reactor_buffer_add(struct reactor_buffer *buf, const void *data,
+        size_t length)
+{
+    if (buf->start + buf->length + length > buf->capacity) {
+        // Slide what's left to the front before growing.
+        if (buf->start > 0) {
+            memmove(buf->data, buf->data + buf->start, buf->length);
+            buf->start = 0;
+        }
+        if (buf->length + length > buf->capacity) {
+            size_t capacity = buf->capacity ? buf->capacity
+                : REACTOR_BUFFER_MIN_CAPACITY;
+            unsigned char *data;
+            while (capacity < buf->length + length)
+                capacity <<= 1;
+            data = realloc(buf->data, capacity);
+            if (!data)
+                return -1;
+            buf->data = data;
+            buf->capacity = capacity;
+        }
+    }
+    memcpy(buf->data + buf->start + buf->length, data, length);
+    buf->length += length;
+    return 0;
+}
+
+int reactor_buffer_remove(struct reactor_buffer *buf, void *data,
+        size_t length)
+{
+    if (length > buf->length)
+        length = buf->length;
+    memcpy(data, buf->data + buf->start, length);
+    reactor_buffer_drain(buf, length);
+    return length;
+}
+
+int reactor_buffer_drain(struct reactor_buffer *buf, size_t length)
+{
+    if (length > buf->length)
+        length = buf->length;
+    buf->length -= length;
+    buf->start = buf->length ? buf->start + length : 0;
+    return 0;
+}
+
+/*
+ * reactor
+ */
+
+struct reactor *reactor_new(void)
+{
+    struct reactor *reactor = calloc(1, sizeof(struct reactor));
+    if (!reactor)
+        return NULL;
+    reactor->epoll_fd = epoll_create(REACTOR_MAX_EVENTS);
+    if (reactor->epoll_fd < 0) {
+        perror("epoll_create");
+        free(reactor);
+        return NULL;
+    }
+    return reactor;
+}
+
+void reactor_free(struct reactor *reactor)
+{
+    struct io_resource *r = reactor->resources;
+    while (r) {
+        struct io_resource *next = r->next;
+        if (r->opened)
+            reactor_close_resource(reactor, r);
+        reactor_buffer_free(r->buffer);
+        free(r->name);
+        if (r->ops->free)
+            r->ops->free(r);
+        r = next;
+    }
+    close(reactor->epoll_fd);
+    free(reactor);
+}
+
+struct io_resource *reactor_add_resource(struct reactor *reactor,
+        const char *name, io_resource_new_t constructor, void *config)
+{
+    struct io_resource *r, **tail;
+
+    r = constructor(config);
+    if (!r)
+        return NULL;
+    r->reactor = reactor;
+    r->name = strdup(name);
+    r->fd = -1;
+    r->buffer = reactor_buffer_new();
+    if (!r->name || !r->buffer) {
+        reactor_buffer_free(r->buffer);
+        free(r->name);
+        if (r->ops->free)
+            r->ops->free(r);
+        return NULL;
+    }
+
+    // Keep them in the order they were added, so they close in reverse.
+    for (tail = &reactor->resources; *tail; tail = &(*tail)->next)
+        ;
+    *tail = r;
+    return r;
+}
+
+int reactor_open_resource(struct reactor *reactor, struct io_resource *r)
+{
+    struct epoll_event ev;
+
+    if (r->opened)
+        return 0;
+    if (r->ops->open && r->ops->open(r) < 0) {
+        fprintf(stderr, "reactor: %s failed to open\n", r->name);
+        return -1;
+    }
+    if (r->fd >= 0) {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = r->events;
+        ev.data.ptr = r;
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, r->fd, &ev) < 0) {
+            perror("epoll_ctl");
+            if (r->ops->close)
+                r->ops->close(r);
+            return -1;
+        }
+    }
+    r->opened = 1;
+    return 0;
+}
+
+int reactor_close_resource(struct reactor *reactor, struct io_resource *r)
+{
+    struct epoll_event ev;
+    int ret = 0;
+
+    if (!r->opened)
+        return 0;
+    if (r->fd >= 0)
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, r->fd, &ev);
+    if (r->ops->close)
+        ret = r->ops->close(r);
+    r->fd = -1;
+    r->opened = 0;
+    return ret;
+}
+
+int reactor_watch(struct io_resource *r, uint32_t events)
+{
+    struct epoll_event ev;
+
+    if (r->events == events)
+        return 0;
+    r->events = events;
+    if (!r->opened || r->fd < 0)
+        return 0;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = r;
+    return epoll_ctl(r->reactor->epoll_fd, EPOLL_CTL_MOD, r->fd, &ev);
+}
+
+static void reactor_step(struct reactor *reactor)
+{
+    struct io_resource *r;
+    for (r = reactor->resources; r && reactor->running; r = r->next)
+        if (r->opened && r->ops->step)
+            r->ops->step(r);
+}
+
+static void reactor_close_all(struct reactor *reactor, struct io_resource *r)
+{
+    if (!r)
+        return;
+    reactor_close_all(reactor, r->next);
+    reactor_close_resource(reactor, r);
+}
+
+int reactor_run(struct reactor *reactor)
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    int n, i;
+
+    reactor->running = 1;
+    reactor_step(reactor);
+    while (reactor->running) {
+        n = epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            reactor->running = 0;
+            break;
+        }
+        for (i = 0; i < n && reactor->running; ++i) {
+            struct io_resource *r = events[i].data.ptr;
+            if (r->opened && r->ops->ready)
+                r->ops->ready(r, events[i].events);
+        }
+        reactor_step(reactor);
+    }
+    reactor_close_all(reactor, reactor->resources);
+    return 0;
+}
+
+void reactor_stop(struct reactor *reactor)
+{
+    reactor->running = 0;
+}
+
+int io_resource_subscribe(struct io_resource *src, struct io_resource *dst)
+{
+    if (src->subscriber_count >= IO_RESOURCE_MAX_SUBSCRIBERS)
+        return -1;
+    src->subscribers[src->subscriber_count++] = dst;
+    return 0;
+}
+
+int io_resource_publish(struct io_resource *r, const void *data,
+        size_t length)
+{
+    int i;
+    for (i = 0; i < r->subscriber_count; ++i) {
+        struct io_resource *s = r->subscribers[i];
+        if (s->opened && s->ops->write)
+            s->ops->write(s, data, length);
+    }
+    return 0;
+}
+
+/*
+ * Timer file descriptors, used by the sampler and the actor.
+ */
+
+static int timerfd_arm(int fd, time_t secs, long nsecs, int periodic)
+{
+    struct itimerspec its;
+    its.it_value.tv_sec = secs;
+    its.it_value.tv_nsec = nsecs;
+    its.it_interval.tv_sec = periodic ? secs : 0;
+    its.it_interval.tv_nsec = periodic ? nsecs : 0;
+    return timerfd_settime(fd, 0, &its, NULL);
+}
+
+static uint64_t timerfd_expirations(int fd)
+{
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return 0;
+    return expirations;
+}
+
+/*
+ * sampler_source
+ */
+
+struct sampler_source {
+    struct io_resource r;
+    int interval_ms;
+};
+
+static int sampler_source_open(struct io_resource *r)
+{
+    struct sampler_source *s = container_of(r, struct sampler_source, r);
+
+    r->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (r->fd < 0) {
+        perror("timerfd_create");
+        return -1;
+    }
+    r->events = EPOLLIN;
+    return timerfd_arm(r->fd, s->interval_ms / 1000,
+            (s->interval_ms % 1000) * 1000000L, 1);
+}
+
+static int sampler_source_close(struct io_resource *r)
+{
+    return close(r->fd);
+}
+
+static int sampler_source_ready(struct io_resource *r, uint32_t events)
+{
+    uint64_t expirations = timerfd_expirations(r->fd);
+    struct timespec now;
+
+    // Late ticks are still ticks; publish one per expiration.
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while (expirations--)
+        io_resource_publish(r, &now, sizeof(now));
+    return 0;
+}
+
+static void sampler_source_free(struct io_resource *r)
+{
+    free(container_of(r, struct sampler_source, r));
+}
+
+static const struct io_resource_ops sampler_source_ops = {
+    .open = sampler_source_open,
+    .close = sampler_source_close,
+    .ready = sampler_source_ready,
+    .free = sampler_source_free,
+};
+
+struct io_resource *sampler_source_new(void *config)
+{
+    struct sampler_source *s = calloc(1, sizeof(struct sampler_source));
+    if (!s)
+        return NULL;
+    s->r.ops = &sampler_source_ops;
+    s->interval_ms = (int)(intptr_t)config;
+    if (s->interval_ms <= 0) {
+        free(s);
+        return NULL;
+    }
+    return &s->r;
+}
+
+/*
+ * upsampler
+ */
+
+struct upsampler {
+    struct io_resource r;
+    int rate;
+    uint32_t *samples;
+};
+
+static int upsampler_open(struct io_resource *r)
+{
+    struct upsampler *u = container_of(r, struct upsampler, r);
+    u->samples = calloc(u->rate, sizeof(uint32_t));
+    return u->samples ? 0 : -1;
+}
+
+static int upsampler_close(struct io_resource *r)
+{
+    struct upsampler *u = container_of(r, struct upsampler, r);
+    free(u->samples);
+    u->samples = NULL;
+    return 0;
+}
+
+static int upsampler_write(struct io_resource *r, const void *data,
+        size_t length)
+{
+    struct upsampler *u = container_of(r, struct upsampler, r);
+    return io_resource_publish(r, u->samples, u->rate * sizeof(uint32_t));
+}
+
+static void upsampler_free(struct io_resource *r)
+{
+    free(container_of(r, struct upsampler, r));
+}
+
+static const struct io_resource_ops upsampler_ops = {
+    .open = upsampler_open,
+    .close = upsampler_close,
+    .write = upsampler_write,
+    .free = upsampler_free,
+};
+
+struct io_resource *upsampler_new(void *config)
+{
+    struct upsampler *u = calloc(1, sizeof(struct upsampler));
+    if (!u)
+        return NULL;
+    u->r.ops = &upsampler_ops;
+    u->rate = (int)(intptr_t)config;
+    if (u->rate <= 0) {
+        free(u);
+        return NULL;
+    }
+    return &u->r;
+}
+
+/*
+ * buffer_sink
+ */
+
+static int buffer_sink_write(struct io_resource *r, const void *data,
+        size_t length)
+{
+    struct buffer_sink *b = container_of(r, struct buffer_sink, r);
+    b->count++;
+    return reactor_buffer_add(r->buffer, data, length);
+}
+
+static void buffer_sink_free(struct io_resource *r)
+{
+    free(container_of(r, struct buffer_sink, r));
+}
+
+static const struct io_resource_ops buffer_sink_ops = {
+    .write = buffer_sink_write,
+    .free = buffer_sink_free,
+};
+
+struct io_resource *buffer_sink_new(void *config)
+{
+    struct buffer_sink *b = calloc(1, sizeof(struct buffer_sink));
+    if (!b)
+        return NULL;
+    b->r.ops = &buffer_sink_ops;
+    return &b->r;
+}
+
+/*
+ * whitebox_sink
+ */
+
+static int whitebox_sink_open(struct io_resource *r)
+{
+    struct whitebox_sink *s = container_of(r, struct whitebox_sink, r);
+    float frequency = s->config.frequency ? s->config.frequency
+        : WHITEBOX_SINK_FREQUENCY;
+
+    whitebox_init(&s->wb);
+    if (whitebox_open(&s->wb, "/dev/whitebox", O_RDWR | O_NONBLOCK,
+                s->config.sample_rate) < 0)
+        return -1;
+    if (whitebox_mmap(&s->wb) < 0)
+        goto fail_close;
+    if (s->config.latency_ms > 0)
+        whitebox_tx_set_latency(&s->wb, s->config.latency_ms);
+    if (whitebox_tx(&s->wb, frequency) < 0)
+        goto fail_munmap;
+    r->fd = whitebox_fd(&s->wb);
+    r->events = 0;
+    s->bytes = 0;
+    return 0;
+
+fail_munmap:
+    whitebox_munmap(&s->wb);
+fail_close:
+    whitebox_close(&s->wb);
+    return -1;
+}
+
+// Moves as much of the buffer as the driver has room for.  Returns the
+// number of bytes written or -1 on error.
+static int whitebox_sink_drain(struct whitebox_sink *s)
+{
+    struct io_resource *r = &s->r;
+    unsigned long dest;
+    long space;
+    size_t count;
+
+    space = ioctl(r->fd, W_MMAP_WRITE, &dest);
+    if (space < 0)
+        return -1;
+    count = reactor_buffer_get_length(r->buffer);
+    if (count > (size_t)space)
+        count = space;
+    count &= ~3;
+    if (count == 0)
+        return 0;
+    reactor_buffer_remove(r->buffer, (void*)dest, count);
+    if (whitebox_tx_commit(&s->wb, count) != (ssize_t)count)
+        return -1;
+    s->bytes += count;
+    return count;
+}
+
+static int whitebox_sink_close(struct io_resource *r)
+{
+    struct whitebox_sink *s = container_of(r, struct whitebox_sink, r);
+    struct pollfd pfd;
+
+    pfd.fd = r->fd;
+    pfd.events = POLLOUT;
+    while (reactor_buffer_get_length(r->buffer) >= 4) {
+        if (poll(&pfd, 1, WHITEBOX_SINK_FLUSH_MS) <= 0
+                || (pfd.revents & POLLERR)
+                || whitebox_sink_drain(s) < 0) {
+            fprintf(stderr, "whitebox_sink: dropped %zd bytes on close\n",
+                    reactor_buffer_get_length(r->buffer));
+            break;
+        }
+    }
+    reactor_buffer_drain(r->buffer, reactor_buffer_get_length(r->buffer));
+    whitebox_tx_standby(&s->wb);
+    whitebox_munmap(&s->wb);
+    return whitebox_close(&s->wb);
+}
+
+static int whitebox_sink_ready(struct io_resource *r, uint32_t events)
+{
+    struct whitebox_sink *s = container_of(r, struct whitebox_sink, r);
+
+    if (events & EPOLLERR) {
+        // Underrun; start the transmitter again as the modem does.
+        s->errors++;
+        whitebox_reset(&s->wb);
+        whitebox_tx(&s->wb, s->wb.frequency);
+    }
+    if ((events & EPOLLOUT) && whitebox_sink_drain(s) < 0)
+        s->errors++;
+    if (reactor_buffer_get_length(r->buffer) < 4)
+        reactor_watch(r, 0);
+    return 0;
+}
+
+static int whitebox_sink_write(struct io_resource *r, const void *data,
+        size_t length)
+{
+    if (reactor_buffer_add(r->buffer, data, length) < 0)
+        return -1;
+    return reactor_watch(r, EPOLLOUT);
+}
+
+static void whitebox_sink_free(struct io_resource *r)
+{
+    free(container_of(r, struct whitebox_sink, r));
+}
+
+static const struct io_resource_ops whitebox_sink_ops = {
+    .open = whitebox_sink_open,
+    .close = whitebox_sink_close,
+    .ready = whitebox_sink_ready,
+    .write = whitebox_sink_write,
+    .free = whitebox_sink_free,
+};
+
+struct io_resource *whitebox_sink_new(void *config)
+{
+    struct whitebox_sink *s = calloc(1, sizeof(struct whitebox_sink));
+    if (!s || !config) {
+        free(s);
+        return NULL;
+    }
+    s->r.ops = &whitebox_sink_ops;
+    memcpy(&s->config, config, sizeof(struct whitebox_sink_config));
+    return &s->r;
+}
+
+/*
+ * actor
+ */
+
+static int actor_open(struct io_resource *r)
+{
+    struct actor *a = container_of(r, struct actor, r);
+
+    r->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (r->fd < 0) {
+        perror("timerfd_create");
+        return -1;
+    }
+    r->events = EPOLLIN;
+    a->pc = 0;
+    a->waiting = 0;
+    a->file_fd = -1;
+    return 0;
+}
+
+static int actor_close(struct io_resource *r)
+{
+    struct actor *a = container_of(r, struct actor, r);
+    if (a->file_fd >= 0) {
+        close(a->file_fd);
+        a->file_fd = -1;
+    }
+    return close(r->fd);
+}
+
+static int actor_ready(struct io_resource *r, uint32_t events)
+{
+    struct actor *a = container_of(r, struct actor, r);
+    if (timerfd_expirations(r->fd) > 0)
+        a->waiting = 0;
+    return 0;
+}
+
+// Feeds the file into the target until it is high enough.  Returns 1 once
+// the file is done.
+static int actor_writef(struct actor *a, struct actor_instr *instr)
+{
+    struct io_resource *dst = instr->a;
+    char chunk[ACTOR_WRITEF_CHUNK];
+    ssize_t n;
+
+    if (a->file_fd < 0) {
+        a->file_fd = open(instr->path, O_RDONLY);
+        if (a->file_fd < 0) {
+            perror(instr->path);
+            return 1;
+        }
+    }
+    while (reactor_buffer_get_length(dst->buffer) < ACTOR_WRITEF_HIGH_WATER) {
+        n = read(a->file_fd, chunk, sizeof(chunk));
+        if (n == 0 && (instr->x & ACTOR_IO_LOOP)) {
+            lseek(a->file_fd, 0, SEEK_SET);
+            continue;
+        }
+        if (n <= 0) {
+            close(a->file_fd);
+            a->file_fd = -1;
+            return 1;
+        }
+        dst->ops->write(dst, chunk, n);
+    }
+    return 0;
+}
+
+static int actor_step(struct io_resource *r)
+{
+    struct actor *a = container_of(r, struct actor, r);
+    struct actor_instr *instr;
+
+    while (!a->waiting && a->pc < a->count) {
+        instr = &a->instrs[a->pc];
+        switch (instr->op) {
+        case ACTOR_OPEN:
+            reactor_open_resource(r->reactor, instr->a);
+            break;
+        case ACTOR_SUB:
+            io_resource_subscribe(instr->a, instr->b);
+            break;
+        case ACTOR_WAIT:
+            timerfd_arm(r->fd, instr->x + instr->y / 1000,
+                    (instr->y % 1000) * 1000000L, 0);
+            a->waiting = 1;
+            break;
+        case ACTOR_HALT:
+            reactor_stop(r->reactor);
+            a->pc = a->count;
+            return 0;
+        case ACTOR_WRITEF:
+            if (!actor_writef(a, instr))
+                return 0;
+            break;
+        }
+        a->pc++;
+    }
+    return 0;
+}
+
+static void actor_free(struct io_resource *r)
+{
+    struct actor *a = container_of(r, struct actor, r);
+    int i;
+    for (i = 0; i < a->count; ++i)
+        free(a->instrs[i].path);
+    free(a);
+}
+
+static const struct io_resource_ops actor_ops = {
+    .open = actor_open,
+    .close = actor_close,
+    .ready = actor_ready,
+    .step = actor_step,
+    .free = actor_free,
+};
+
+struct io_resource *actor_new(void *config)
+{
+    struct actor *a = calloc(1, sizeof(struct actor));
+    if (!a)
+        return NULL;
+    a->r.ops = &actor_ops;
+    a->file_fd = -1;
+    return &a->r;
+}
+
+static struct actor_instr *actor_next_instr(struct actor *actor,
+        enum actor_op op)
+{
+    struct actor_instr *instr;
+    if (actor->count >= ACTOR_MAX_INSTRS)
+        return NULL;
+    instr = &actor->instrs[actor->count++];
+    memset(instr, 0, sizeof(*instr));
+    instr->op = op;
+    return instr;
+}
+
+int actor_add_open_instr(struct actor *actor, struct io_resource *r)
+{
+    struct actor_instr *instr = actor_next_instr(actor, ACTOR_OPEN);
+    if (!instr)
+        return -1;
+    instr->a = r;
+    return 0;
+}
+
+int actor_add_sub_instr(struct actor *actor, struct io_resource *src,
+        struct io_resource *dst)
+{
+    struct actor_instr *instr = actor_next_instr(actor, ACTOR_SUB);
+    if (!instr)
+        return -1;
+    instr->a = src;
+    instr->b = dst;
+    return 0;
+}
+
+int actor_add_instr(struct actor *actor, const char *name, int x, int y,
+        void *data)
+{
+    struct actor_instr *instr;
+    if (strcmp(name, "wait") == 0)
+        instr = actor_next_instr(actor, ACTOR_WAIT);
+    else if (strcmp(name, "halt") == 0)
+        instr = actor_next_instr(actor, ACTOR_HALT);
+    else
+        return -1;
+    if (!instr)
+        return -1;
+    instr->x = x;
+    instr->y = y;
+    return 0;
+}
+
+int actor_add_io_instr(struct actor *actor, const char *name,
+        struct io_resource *r, const char *path, int flags)
+{
+    struct actor_instr *instr;
+    if (strcmp(name, "writef") != 0)
+        return -1;
+    instr = actor_next_instr(actor, ACTOR_WRITEF);
+    if (!instr)
+        return -1;
+    instr->a = r;
+    instr->x = flags;
+    instr->path = strdup(path);
+    return 0;
+}
@@ -0,0 +1,232 @@
+#ifndef __WHITEBOX_REACTOR_H__
+#define __WHITEBOX_REACTOR_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "whitebox.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef container_of
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+#endif
+
+/*
+ * Byte queue with the calls of libevent's evbuffer that the resources need,
+ * under names of its own so it doesn't clash with libevent when both are
+ * linked.  Data is added at the end and removed from the front.
+ */
+struct reactor_buffer {
+    unsigned char *data;
+    size_t start;
+    size_t length;
+    size_t capacity;
+};
+
+struct reactor_buffer *reactor_buffer_new(void);
+void reactor_buffer_free(struct reactor_buffer *buf);
+size_t reactor_buffer_get_length(const struct reactor_buffer *buf);
+int reactor_buffer_add(struct reactor_buffer *buf, const void *data,
+        size_t length);
+int reactor_buffer_remove(struct reactor_buffer *buf, void *data,
+        size_t length);
+int reactor_buffer_drain(struct reactor_buffer *buf, size_t length);
+
+#define IO_RESOURCE_MAX_SUBSCRIBERS 8
+
+struct reactor;
+struct io_resource;
+
+/*
+ * What a resource does.  open and close claim and release whatever the
+ * resource needs, setting fd and events if it wants to be polled.  ready
+ * is called with the epoll events when the fd is ready.  write delivers
+ * data published by a resource this one subscribes to.  step, if present,
+ * runs once per pass of the reactor loop.  free releases the resource's
+ * own memory.  Any of them may be NULL.
+ */
+struct io_resource_ops {
+    int (*open)(struct io_resource *r);
+    int (*close)(struct io_resource *r);
+    int (*ready)(struct io_resource *r, uint32_t events);
+    int (*write)(struct io_resource *r, const void *data, size_t length);
+    int (*step)(struct io_resource *r);
+    void (*free)(struct io_resource *r);
+};
+
+/*
+ * Embedded at the start of every resource type, recovered with
+ * container_of().
+ */
+struct io_resource {
+    const struct io_resource_ops *ops;
+    struct reactor *reactor;
+    char *name;
+    int fd;
+    uint32_t events;
+    int opened;
+    struct reactor_buffer *buffer;
+    struct io_resource *subscribers[IO_RESOURCE_MAX_SUBSCRIBERS];
+    int subscriber_count;
+    struct io_resource *next;
+};
+
+typedef struct io_resource *(*io_resource_new_t)(void *config);
+
+struct reactor {
+    int epoll_fd;
+    int running;
+    struct io_resource *resources;
+};
+
+struct reactor *reactor_new(void);
+void reactor_free(struct reactor *reactor);
+
+/*
+ * Creates a resource with the given constructor and config and hands it
+ * to the reactor, which frees it in reactor_free().  Returns NULL on
+ * failure.
+ */
+struct io_resource *reactor_add_resource(struct reactor *reactor,
+        const char *name, io_resource_new_t constructor, void *config);
+
+int reactor_open_resource(struct reactor *reactor, struct io_resource *r);
+int reactor_close_resource(struct reactor *reactor, struct io_resource *r);
+
+/*
+ * Changes the epoll events an open resource is waiting for.
+ */
+int reactor_watch(struct io_resource *r, uint32_t events);
+
+/*
+ * Runs until reactor_stop(), then closes every open resource.
+ */
+int reactor_run(struct reactor *reactor);
+void reactor_stop(struct reactor *reactor);
+
+/*
+ * Makes dst receive everything src publishes.
+ */
+int io_resource_subscribe(struct io_resource *src, struct io_resource *dst);
+
+/*
+ * Passes data to the write op of each open subscriber.
+ */
+int io_resource_publish(struct io_resource *r, const void *data,
+        size_t length);
+
+/*
+ * Publishes the CLOCK_MONOTONIC time, as a struct timespec, every
+ * interval milliseconds.  config is the interval cast to a pointer.
+ */
+struct io_resource *sampler_source_new(void *config);
+
+/*
+ * Turns each event it is written into config (cast to a pointer) packed
+ * I/Q samples of silence, as a stand-in sample stream clocked by whatever
+ * it subscribes to.
+ */
+struct io_resource *upsampler_new(void *config);
+
+/*
+ * Appends whatever is written to it to its buffer, counting the writes.
+ */
+struct buffer_sink {
+    struct io_resource r;
+    int count;
+};
+
+struct io_resource *buffer_sink_new(void *config);
+
+/*
+ * Transmits whatever is written to it through /dev/whitebox, draining its
+ * buffer into the mapped DMA buffer as the driver makes room.  Closing it
+ * flushes the buffer first.  A zero frequency means the default.
+ */
+#define WHITEBOX_SINK_FREQUENCY 145e6
+
+struct whitebox_sink_config {
+    int sample_rate;
+    int latency_ms;
+    float frequency;
+};
+
+struct whitebox_sink {
+    struct io_resource r;
+    struct whitebox_sink_config config;
+    whitebox_t wb;
+    int bytes;
+    int errors;
+};
+
+struct io_resource *whitebox_sink_new(void *config);
+
+/*
+ * Runs a short script once opened: opening resources, wiring them
+ * together, waiting, streaming files into resources and stopping the
+ * reactor.
+ */
+#define ACTOR_MAX_INSTRS        32
+#define ACTOR_WRITEF_CHUNK      4096
+#define ACTOR_WRITEF_HIGH_WATER (4 * ACTOR_WRITEF_CHUNK)
+
+// Flags for actor_add_io_instr()
+#define ACTOR_IO_LOOP           (1 << 0)    // Rewind at end of file
+
+enum actor_op {
+    ACTOR_OPEN,
+    ACTOR_SUB,
+    ACTOR_WAIT,
+    ACTOR_HALT,
+    ACTOR_WRITEF,
+};
+
+struct actor_instr {
+    enum actor_op op;
+    struct io_resource *a;
+    struct io_resource *b;
+    int x;
+    int y;
+    char *path;
+};
+
+struct actor {
+    struct io_resource r;
+    struct actor_instr instrs[ACTOR_MAX_INSTRS];
+    int count;
+    int pc;
+    int waiting;
+    int file_fd;
+};
+
+struct io_resource *actor_new(void *config);
+
+int actor_add_open_instr(struct actor *actor, struct io_resource *r);
+int actor_add_sub_instr(struct actor *actor, struct io_resource *src,
+        struct io_resource *dst);
+
+/*
+ * "wait" for x seconds plus y milliseconds, or "halt" the reactor.
+ * Returns -1 for anything else or a full script.
+ */
+int actor_add_instr(struct actor *actor, const char *name, int x, int y,
+        void *data);
+
+/*
+ * "writef": stream the file at path into r, keeping no more than
+ * ACTOR_WRITEF_HIGH_WATER bytes queued in r's buffer.
+ */
+int actor_add_io_instr(struct actor *actor, const char *name,
+        struct io_resource *r, const char *path, int flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __WHITEBOX_REACTOR_H__ */
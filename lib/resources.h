@@ -45,10 +45,14 @@ void resource_handler(struct resource *,
         struct pollfd *, int);
 int resource_setup(struct resource *, const char *, struct resource_ops *);
 
-typedef int16_t (*source_next)();
+// Fill samples with up to count samples of audio, returning how many it
+// had.  Generators always fill the lot; a live source such as the mic
+// returns only what has been captured, and the caller pads if it must.
+typedef int (*source_next)(int16_t *samples, int count);
 extern source_next source;
 
-typedef void (*sink_cb)(int16_t sample);
+// Consume count samples of audio.
+typedef void (*sink_cb)(const int16_t *samples, int count);
 extern sink_cb sink;
 
 #ifdef __cplusplus
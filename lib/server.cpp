@@ -12,15 +12,21 @@
 #include <cerrno>
 #include <iostream>
 #include <sstream>
+#include <map>
+#include <string>
 #include <unistd.h>
+#include <dirent.h>
 #include <pthread.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
 #include <arpa/inet.h>
+#include <zlib.h>
 extern "C" {
 #include <openssl/ssl.h>
 }
-#include "cJSON.h"
+#include "json_stream.h"
 #include "radio.h"
 
 #define ETC_DIR "/etc/"
@@ -58,19 +64,63 @@ static const suffix_and_type type_table[] = {
   { 0, 0 }
 };
 
+// web_content is read into memory when the server starts, so that static
+// files are served without stat() or reading flash.  Each file keeps a
+// hash of its content for an ETag, and a gzip copy if that is smaller.
+// The gzip copy is a different representation, so it has its own ETag.
+// A directory is kept as an entry with is_directory set, and maps to its
+// index.html.  Files that don't fit, or appear later, are served from the
+// filesystem as before.
+#define WEB_CACHE_MAX_FILE	(256 * 1024)
+#define WEB_CACHE_MAX_TOTAL	(1024 * 1024)
+#define WEB_CACHE_CHUNK		4096
+
+struct web_asset {
+  bool				is_directory;
+  const char *			mime_type;
+  char				etag[32];
+  char				gzip_etag[32];
+  std::string			body;
+  std::string			gzip_body;	// Empty if it didn't help.
+};
+
+typedef std::map<std::string, web_asset *>	web_cache_map;
+
+static web_cache_map		web_cache;
+
 struct client_context {
   radio_context *               radio;   // Opaque user-defined context.
   client_info			info;
   libwebsocket *                wsi;
   libwebsocket_context *	websocket_context;
-  WriteBuffer *			buffers;
-  WriteBuffer *			last_buffer;
+  const std::string *		http_body; // Cached file being sent over HTTP.
+  size_t			http_sent;
+  // Ring of references to the buffers still to be written, oldest at
+  // queue_head.  The frames themselves are shared with other clients.
+  WriteBuffer * *		queue;
+  unsigned int			queue_size;
+  unsigned int			queue_head;
+  unsigned int			queued;
+  unsigned int			queue_high_water;
+  unsigned long			dropped; // Buffers the queue had no room for.
   bool				open;
+  client_context *		next_client;
+};
+
+// Open radio-server-1 connections, for server_broadcast().
+static client_context *		clients = 0;
+
+static unsigned int		queue_depth = SERVER_QUEUE_DEPTH;
+static send_policy		send_policies[SERVER_FRAME_TYPES] = {
+  SEND_COALESCE,	// Status JSON.
+  SEND_DROP_OLDEST,	// Receive audio.
+  SEND_DROP_NEWEST,
+  SEND_DROP_NEWEST
 };
 
 typedef int (*command_function)(
  const char *,
- cJSON *,
+ const radio_settings *,
  client_context *);
 
 struct command_processor {
@@ -86,11 +136,13 @@ static const int NID_dxccEntity = OBJ_create("1.3.6.1.4.1.12348.1.4",
    "Distant eXchange Century Club (DXCC) entity index value",
    "DXCC entity");
 
-static int close(const char *, cJSON *, client_context *);
-static int receive(const char *, cJSON *, client_context *);
-static int set(const char *, cJSON *, client_context *);
-static void send_status(client_context *);
-static int transmit(const char *, cJSON *, client_context *);
+static void client_closed(client_context *);
+static int close(const char *, const radio_settings *, client_context *);
+static int receive(const char *, const radio_settings *, client_context *);
+static int scan(const char *, const radio_settings *, client_context *);
+static int set(const char *, const radio_settings *, client_context *);
+static void send_status();
+static int transmit(const char *, const radio_settings *, client_context *);
 
 static int
 command(char * text, int length, client_context *);
@@ -105,6 +157,7 @@ static const command_processor  commands[] = {
   { "close",    close },
   { "receive",  receive },
   { "transmit", transmit },
+  { "scan", scan },
   { "set", set },
   { 0, 0 }
 };
@@ -112,9 +165,165 @@ static const command_processor  commands[] = {
 const size_t pad_size = LWS_SEND_BUFFER_PRE_PADDING + sizeof(uint32_t)
  + LWS_SEND_BUFFER_POST_PADDING;
 
+// The M3 has no MMU, so a new[] and delete[] for every frame slowly
+// fragments the heap.  WriteBuffer storage is instead kept on a free list
+// per size class, each block big enough for the class's largest payload
+// plus the padding libwebsocket_write() needs.  Payloads bigger than the
+// largest class come from the heap as before.
+static const size_t	write_buffer_sizes[WRITE_BUFFER_CLASSES] = {
+  256, 1024, 4096
+};
+
+struct pool_block {
+  pool_block *	next;
+};
+
+struct write_buffer_class {
+  pool_block *	free_list;
+  unsigned int	free;
+  unsigned int	in_use;
+  unsigned int	high_water;
+  unsigned long	misses;
+};
+
+static write_buffer_class	write_buffer_classes[WRITE_BUFFER_CLASSES];
+static unsigned int		write_buffer_capacity = WRITE_BUFFER_CAPACITY;
+static unsigned long		write_buffer_oversize = 0;
+
+// Recycled WriteBuffer objects.
+static pool_block *		write_buffer_objects = 0;
+static unsigned int		write_buffer_objects_free = 0;
+
+static int
+write_buffer_class_of(size_t length)
+{
+  for ( int i = 0; i < WRITE_BUFFER_CLASSES; i++ ) {
+    if ( length <= write_buffer_sizes[i] )
+      return i;
+  }
+  return -1;
+}
+
+static unsigned char *
+write_buffer_get(size_t length)
+{
+  const int i = write_buffer_class_of(length);
+
+  if ( i < 0 ) {
+    write_buffer_oversize++;
+    return new unsigned char[length + pad_size];
+  }
+
+  write_buffer_class &	c = write_buffer_classes[i];
+  unsigned char *	storage;
+
+  if ( c.free_list ) {
+    storage = (unsigned char *)c.free_list;
+    c.free_list = c.free_list->next;
+    c.free--;
+  }
+  else {
+    storage = new unsigned char[write_buffer_sizes[i] + pad_size];
+    c.misses++;
+  }
+  if ( ++c.in_use > c.high_water )
+    c.high_water = c.in_use;
+  return storage;
+}
+
+static void
+write_buffer_put(unsigned char * storage, size_t length)
+{
+  const int i = write_buffer_class_of(length);
+
+  if ( i < 0 ) {
+    delete[] storage;
+    return;
+  }
+
+  write_buffer_class &	c = write_buffer_classes[i];
+
+  c.in_use--;
+  if ( c.free >= write_buffer_capacity ) {
+    delete[] storage;
+    return;
+  }
+  pool_block * const b = (pool_block *)storage;
+  b->next = c.free_list;
+  c.free_list = b;
+  c.free++;
+}
+
+void
+write_buffer_pool_configure(unsigned int capacity)
+{
+  write_buffer_capacity = capacity;
+  for ( int i = 0; i < WRITE_BUFFER_CLASSES; i++ ) {
+    write_buffer_class & c = write_buffer_classes[i];
+
+    while ( c.free > capacity ) {
+      pool_block * const b = c.free_list;
+      c.free_list = b->next;
+      c.free--;
+      delete[] (unsigned char *)b;
+    }
+    while ( c.free < capacity ) {
+      pool_block * const b = (pool_block *)
+       new unsigned char[write_buffer_sizes[i] + pad_size];
+      b->next = c.free_list;
+      c.free_list = b;
+      c.free++;
+    }
+  }
+}
+
+void
+write_buffer_pool_stats(
+ write_buffer_stats	stats[WRITE_BUFFER_CLASSES],
+ unsigned long *	oversize)
+{
+  for ( int i = 0; i < WRITE_BUFFER_CLASSES; i++ ) {
+    const write_buffer_class & c = write_buffer_classes[i];
+
+    stats[i].size = write_buffer_sizes[i];
+    stats[i].free = c.free;
+    stats[i].in_use = c.in_use;
+    stats[i].high_water = c.high_water;
+    stats[i].misses = c.misses;
+  }
+  *oversize = write_buffer_oversize;
+}
+
+void *
+WriteBuffer::operator new(size_t size)
+{
+  if ( size == sizeof(WriteBuffer) && write_buffer_objects ) {
+    pool_block * const b = write_buffer_objects;
+    write_buffer_objects = b->next;
+    write_buffer_objects_free--;
+    return b;
+  }
+  return ::operator new(size);
+}
+
+void
+WriteBuffer::operator delete(void * p)
+{
+  if ( !p )
+    return;
+  if ( write_buffer_objects_free >= write_buffer_capacity * WRITE_BUFFER_CLASSES ) {
+    ::operator delete(p);
+    return;
+  }
+  pool_block * const b = (pool_block *)p;
+  b->next = write_buffer_objects;
+  write_buffer_objects = b;
+  write_buffer_objects_free++;
+}
+
 WriteBuffer::WriteBuffer(size_t l, uint32_t _type)
-: storage(new unsigned char[l + pad_size]),
-  buf(&storage[LWS_SEND_BUFFER_PRE_PADDING + sizeof(uint32_t)]), next(0), maxLength(l), size(l)
+: storage(write_buffer_get(l)),
+  buf(&storage[LWS_SEND_BUFFER_PRE_PADDING + sizeof(uint32_t)]), refs(1), maxLength(l), size(l)
 {
   unsigned char * const	d = buf - sizeof(uint32_t);
   *(uint32_t *)d = _type;
@@ -122,7 +331,7 @@ WriteBuffer::WriteBuffer(size_t l, uint32_t _type)
 
 WriteBuffer::~WriteBuffer()
 {
-  delete[] storage;
+  write_buffer_put(storage, maxLength);
 }
 
 static void
@@ -184,6 +393,290 @@ get_headers(libwebsocket_context * context, libwebsocket * wsi, client_context *
   client->info.user_agent = strdup(value);
 }
 
+static const char *
+mime_type_of(const char * path, const char * default_type)
+{
+  const char * dot = rindex(path, '.');
+
+  if ( dot ) {
+    dot++;
+    for ( const suffix_and_type * t = type_table; t->suffix != 0; t++ ) {
+      if ( strcmp(dot, t->suffix) == 0 )
+        return t->mime_type;
+    }
+  }
+  return default_type;
+}
+
+// Compresses in into out as a gzip stream.  Returns false on failure.
+static bool
+gzip_string(const std::string & in, std::string & out)
+{
+  z_stream	z;
+
+  memset(&z, 0, sizeof(z));
+  // 16 added to the window bits asks for a gzip header rather than zlib's.
+  if ( deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+   Z_DEFAULT_STRATEGY) != Z_OK )
+    return false;
+
+  out.resize(deflateBound(&z, in.size()));
+  z.next_in = (Bytef *)in.data();
+  z.avail_in = in.size();
+  z.next_out = (Bytef *)&out[0];
+  z.avail_out = out.size();
+
+  const int	status = deflate(&z, Z_FINISH);
+  out.resize(z.total_out);
+  deflateEnd(&z);
+  return status == Z_STREAM_END;
+}
+
+static bool
+web_cache_file(const std::string & name, const std::string & path, size_t & total)
+{
+  FILE * const	f = fopen(path.c_str(), "rb");
+
+  if ( !f )
+    return false;
+
+  web_asset * const	a = new web_asset;
+  char			buf[WEB_CACHE_CHUNK];
+  size_t		n;
+
+  while ( (n = fread(buf, 1, sizeof(buf), f)) > 0 )
+    a->body.append(buf, n);
+  fclose(f);
+
+  if ( total + a->body.size() > WEB_CACHE_MAX_TOTAL ) {
+    delete a;
+    return false;
+  }
+
+  a->is_directory = false;
+  a->mime_type = mime_type_of(name.c_str(), "text/plain");
+  const unsigned long	crc = crc32(
+   crc32(0, Z_NULL, 0),
+   (const Bytef *)a->body.data(),
+   a->body.size());
+  snprintf(a->etag, sizeof(a->etag), "\"%08lx-%lx\"",
+   crc, (unsigned long)a->body.size());
+  snprintf(a->gzip_etag, sizeof(a->gzip_etag), "\"%08lx-%lx-gz\"",
+   crc, (unsigned long)a->body.size());
+
+  // Images and archives that are already compressed don't get smaller.
+  if ( gzip_string(a->body, a->gzip_body)
+   && a->gzip_body.size() + a->gzip_body.size() / 8 < a->body.size() )
+    total += a->gzip_body.size();
+  else
+    a->gzip_body.clear();
+
+  total += a->body.size();
+  web_cache[name] = a;
+  return true;
+}
+
+// name is relative to web_content, and ends in '/' unless it is empty.
+static void
+web_cache_directory(const std::string & name, const std::string & path, size_t & total)
+{
+  DIR * const	d = opendir(path.c_str());
+
+  if ( !d )
+    return;
+
+  web_asset * const	a = new web_asset;
+  a->is_directory = true;
+  a->mime_type = 0;
+  a->etag[0] = '\0';
+  a->gzip_etag[0] = '\0';
+  web_cache[name] = a;
+  if ( !name.empty() )
+    web_cache[name.substr(0, name.size() - 1)] = a;
+
+  const dirent *	e;
+  while ( (e = readdir(d)) != 0 ) {
+    struct stat		st;
+
+    if ( e->d_name[0] == '.' )
+      continue;
+
+    const std::string	entry_name = name + e->d_name;
+    const std::string	entry_path = path + e->d_name;
+
+    if ( stat(entry_path.c_str(), &st) != 0 )
+      continue;
+    if ( S_ISDIR(st.st_mode) )
+      web_cache_directory(entry_name + "/", entry_path + "/", total);
+    else if ( S_ISREG(st.st_mode) && st.st_size <= WEB_CACHE_MAX_FILE )
+      web_cache_file(entry_name, entry_path, total);
+  }
+  closedir(d);
+}
+
+static void
+web_cache_load(const char * dirname)
+{
+  size_t	total = 0;
+
+  web_cache_directory("", dirname, total);
+  std::cerr << "Cached " << web_cache.size() << " web content entries, "
+   << total << " bytes." << std::endl;
+}
+
+// Returns the ETag of a's representation that the If-None-Match header
+// names, either one if it says "*", or 0 if none.
+static const char *
+etag_matches(libwebsocket * wsi, const web_asset * a, bool gzip)
+{
+  char	value[256];
+
+  value[0] = '\0';
+  if ( lws_hdr_copy(wsi, value, sizeof(value), WSI_TOKEN_HTTP_IF_NONE_MATCH) <= 0 )
+    return 0;
+  if ( strcmp(value, "*") == 0 )
+    return gzip ? a->gzip_etag : a->etag;
+  if ( strstr(value, a->etag) != 0 )
+    return a->etag;
+  if ( !a->gzip_body.empty() && strstr(value, a->gzip_etag) != 0 )
+    return a->gzip_etag;
+  return 0;
+}
+
+static bool
+accepts_gzip(libwebsocket * wsi)
+{
+  char	value[256];
+
+  value[0] = '\0';
+  if ( lws_hdr_copy(wsi, value, sizeof(value), WSI_TOKEN_HTTP_ACCEPT_ENCODING) <= 0 )
+    return false;
+  return strstr(value, "gzip") != 0;
+}
+
+static void
+add_header(
+ libwebsocket_context *		context,
+ libwebsocket *			wsi,
+ const char *			name,
+ const char *			value,
+ unsigned char * *		p,
+ unsigned char *		end)
+{
+  lws_add_http_header_by_name(
+   context,
+   wsi,
+   (const unsigned char *)name,
+   (const unsigned char *)value,
+   strlen(value),
+   p,
+   end);
+}
+
+// Writes as much of the cached body as the socket takes.  Returns what the
+// HTTP callback should: -1 to close once the body is done and the
+// connection isn't kept alive, 0 otherwise.
+static int
+serve_cached_body(libwebsocket_context * context, libwebsocket * wsi, client_context * client)
+{
+  const std::string * const	body = client->http_body;
+
+  while ( client->http_sent < body->size() ) {
+    size_t	n = body->size() - client->http_sent;
+
+    if ( n > WEB_CACHE_CHUNK )
+      n = WEB_CACHE_CHUNK;
+    if ( libwebsocket_write(
+     wsi,
+     (unsigned char *)&(*body)[client->http_sent],
+     n,
+     LWS_WRITE_HTTP) < 0 ) {
+      client->http_body = 0;
+      return -1;
+    }
+    client->http_sent += n;
+
+    if ( client->http_sent < body->size()
+     && (lws_partial_buffered(wsi) || lws_send_pipe_choked(wsi)) ) {
+      libwebsocket_callback_on_writable(context, wsi);
+      return 0;
+    }
+  }
+  client->http_body = 0;
+  if ( lws_http_transaction_completed(wsi) )
+    return -1;
+  else
+    return 0;
+}
+
+// Serves a cached file, or answers 304 if the client already has it.
+// The browser is told to revalidate every time, which costs a 304, so an
+// updated katena.js is picked up on the next load.
+static int
+serve_cached(
+ libwebsocket_context *		context,
+ libwebsocket *			wsi,
+ client_context *		client,
+ const web_asset *		a)
+{
+  static const char	cache_advice[] = "private, no-cache";
+  unsigned char		buf[512];
+  unsigned char *	p = buf;
+  unsigned char * const	end = &buf[sizeof(buf) - 1];
+  const bool		gzip = !a->gzip_body.empty() && accepts_gzip(wsi);
+  const std::string &	body = gzip ? a->gzip_body : a->body;
+  const char * const	matched = etag_matches(wsi, a, gzip);
+  const bool		not_modified = matched != 0;
+
+  // A 304 names the copy the client already has.
+  lws_add_http_header_status(context, wsi, not_modified ? 304 : 200, &p, end);
+  add_header(
+   context,
+   wsi,
+   "ETag:",
+   matched ? matched : gzip ? a->gzip_etag : a->etag,
+   &p,
+   end);
+  lws_add_http_header_by_token(
+   context,
+   wsi,
+   WSI_TOKEN_HTTP_CACHE_CONTROL,
+   (const unsigned char *)cache_advice,
+   sizeof(cache_advice) - 1,
+   &p,
+   end);
+  if ( !a->gzip_body.empty() )
+    add_header(context, wsi, "Vary:", "Accept-Encoding", &p, end);
+
+  if ( not_modified ) {
+    lws_finalize_http_header(context, wsi, &p, end);
+    libwebsocket_write(wsi, buf, (size_t)(p - buf), LWS_WRITE_HTTP);
+    if ( lws_http_transaction_completed(wsi) )
+      return -1;
+    else
+      return 0;
+  }
+
+  lws_add_http_header_by_token(
+   context,
+   wsi,
+   WSI_TOKEN_HTTP_CONTENT_TYPE,
+   (const unsigned char *)a->mime_type,
+   strlen(a->mime_type),
+   &p,
+   end);
+  if ( gzip )
+    add_header(context, wsi, "Content-Encoding:", "gzip", &p, end);
+  lws_add_http_header_content_length(context, wsi, body.size(), &p, end);
+  lws_finalize_http_header(context, wsi, &p, end);
+  if ( libwebsocket_write(wsi, buf, (size_t)(p - buf), LWS_WRITE_HTTP) < 0 )
+    return -1;
+
+  client->http_body = &body;
+  client->http_sent = 0;
+  return serve_cached_body(context, wsi, client);
+}
+
 static int
 serve_string(
  libwebsocket_context *         context,
@@ -401,6 +894,39 @@ static int callback_http(
 	   in,
 	   len);
 
+	web_cache_map::const_iterator cached = web_cache.find(i);
+	if ( cached != web_cache.end() ) {
+	  const web_asset * a = cached->second;
+
+	  if ( a->is_directory && length > 0 && i[length - 1] != '/' ) {
+	    // We're asked for a directory without the trailing slash.
+	    // Redirect, adding the trailing slash.
+	    unsigned char buf[1024];
+	    unsigned char * p = buf;
+	    unsigned char * const end = &buf[sizeof(buf) - 1];
+	    const std::string location = std::string(i) + "/";
+
+	    lws_add_http_header_status(context, wsi, 301, &p, end);
+	    lws_add_http_header_by_token(
+	     context,
+	     wsi,
+	     WSI_TOKEN_HTTP_LOCATION,
+	     (const unsigned char *)location.c_str(),
+	     location.size(),
+	     &p,
+	     end);
+	    lws_finalize_http_header(context, wsi, &p, end);
+	    libwebsocket_write(wsi, buf, (size_t)(p - buf), LWS_WRITE_HTTP);
+	    break;
+	  }
+	  if ( a->is_directory ) {
+	    cached = web_cache.find(std::string(i) + "index.html");
+	    a = cached != web_cache.end() ? cached->second : 0;
+	  }
+	  if ( a )
+	    return serve_cached(context, wsi, client, a);
+	}
+
 	if ( strstr(i, "/../") 
 	 ||  strcmp(i, "..") == 0
 	 ||  strncmp(i, "../", 3) == 0
@@ -468,18 +994,7 @@ static int callback_http(
 	  mime_type = "text/html";
 	}
 
-	const char * dot = rindex(i, '.');
-	if ( dot ) {
-	  dot++;
-	  const suffix_and_type * t = type_table;
-	  while ( t->suffix != 0 ) {
-	    if ( strcmp(dot, t->suffix) == 0 ) {
-	      mime_type = t->mime_type;
-	      break;
-	    }
-	    t++;
-	  }
-	}
+	mime_type = mime_type_of(i, mime_type);
 
 	int status = libwebsockets_serve_http_file(
 	 context,
@@ -495,6 +1010,11 @@ static int callback_http(
           break;
       }
 
+    case LWS_CALLBACK_HTTP_WRITEABLE:
+      if ( client->http_body )
+        return serve_cached_body(context, wsi, client);
+      return 0;
+
     case LWS_CALLBACK_OPENSSL_LOAD_EXTRA_SERVER_VERIFY_CERTS:
       {
         SSL_CTX * ssl_context = (SSL_CTX *)user;
@@ -536,31 +1056,46 @@ static int callback_radioserver(
         client->wsi = wsi;
         client->websocket_context = context;
 
+        client->queue_size = queue_depth;
+        client->queue = new WriteBuffer *[client->queue_size];
+        client->queue_head = 0;
+        client->queued = 0;
+
         client->radio = radio_start(client, &client->info);
         client->open = true;
-        send_status(client);
+        client->next_client = clients;
+        clients = client;
+        server_status_changed();
       }
       break;
 
     case LWS_CALLBACK_SERVER_WRITEABLE:
+      // libwebsocket_write() frames the data in the pre-padding of the
+      // shared buffer.  The header is the same for every client, since the
+      // server never masks and no extensions are offered, so clients that
+      // share a buffer just write the same bytes there.  Anything the socket
+      // won't take is copied by libwebsockets, so the reference can go as
+      // soon as the write returns.
       if ( client->open ) {
-        WriteBuffer * b = client->buffers;
-        while ( b ) {
-          WriteBuffer * const old = b;
+        while ( client->queued ) {
+          WriteBuffer * const	b = client->queue[client->queue_head];
           unsigned char * const	d = b->data() - sizeof(uint32_t);
 
-          libwebsocket_write(wsi, d, b->length(), LWS_WRITE_BINARY);
-          b = b->link();
-          delete old;
+          // The frame is the type word and then the payload.
+          libwebsocket_write(
+           wsi,
+           d,
+           b->length() + sizeof(uint32_t),
+           LWS_WRITE_BINARY);
+          client->queue_head = (client->queue_head + 1) % client->queue_size;
+          client->queued--;
+          b->release();
  
-          if ( b && (lws_partial_buffered(client->wsi) || lws_send_pipe_choked(client->wsi))){
-            client->buffers = b;
+          if ( client->queued && (lws_partial_buffered(client->wsi) || lws_send_pipe_choked(client->wsi))){
             libwebsocket_callback_on_writable(client->websocket_context, client->wsi);
             return 0;
           }
         }
-        client->buffers = 0;
-        client->last_buffer = 0;
       }
       break;
 
@@ -583,6 +1118,7 @@ static int callback_radioserver(
         client->radio = 0;
         client->open = false;
       }
+      client_closed(client);
       break;
 
     default:
@@ -591,45 +1127,132 @@ static int callback_radioserver(
   return 0;
 }
 
+// Take the client off the broadcast list. Safe to call more than once.
+static void
+client_closed(client_context * client)
+{
+  client_context * *	c = &clients;
+
+  while ( *c ) {
+    if ( *c == client ) {
+      *c = client->next_client;
+      break;
+    }
+    c = &(*c)->next_client;
+  }
+  client->next_client = 0;
+
+  // Let go of whatever never went out.
+  while ( client->queued ) {
+    client->queue[client->queue_head]->release();
+    client->queue_head = (client->queue_head + 1) % client->queue_size;
+    client->queued--;
+  }
+  delete [] client->queue;
+  client->queue = 0;
+}
+
 static int
-close(const char *, cJSON *, client_context * client)
+close(const char *, const radio_settings *, client_context * client)
 {
   radio_end(client->radio, &client->info);
   client->radio = 0;
   client->open = false;
+  client_closed(client);
 
   // This return value causes the server to disconnect.
   return 1;
 }
 
+// What command_member() picks out of a command.  Anything else in the
+// object is ignored.
+struct command_fields {
+  char			command[16];
+  radio_settings	settings;
+
+  			command_fields() { command[0] = '\0'; }
+};
+
+static int
+command_member(const json_token * name, const json_token * value, void * context)
+{
+  command_fields * const	f = (command_fields *)context;
+
+  if ( json_token_equals(name, "command") ) {
+    if ( json_token_copy(value, f->command, sizeof(f->command)) < 0 )
+      return -1;
+  }
+  // katena.js sends null for a frequency that doesn't parse; leave it be.
+  else if ( json_token_equals(name, "frequency") ) {
+    if ( json_token_double(value, &f->settings.frequency) == 0 )
+      f->settings.has_frequency = true;
+  }
+  else if ( json_token_equals(name, "mode") && value->type == JSON_STRING ) {
+    if ( json_token_copy(value, f->settings.mode, sizeof(f->settings.mode)) < 0 )
+      return -1;
+  }
+  // A scan's range.  Anything that doesn't parse stays 0, which scan() turns
+  // away.
+  else if ( json_token_equals(name, "start") )
+    json_token_double(value, &f->settings.start);
+  else if ( json_token_equals(name, "stop") )
+    json_token_double(value, &f->settings.stop);
+  else if ( json_token_equals(name, "step") )
+    json_token_double(value, &f->settings.step);
+  else if ( json_token_equals(name, "dwell") )
+    json_token_double(value, &f->settings.dwell);
+  return 0;
+}
+
+// Commands arrive at the rate a slider moves, so they are scanned in place
+// rather than parsed into a cJSON tree.
 static int
 command(
  char *                         text,
- int                            /* length */,
+ int                            length,
  client_context *               client)
 {
   const command_processor * c = commands;
+  command_fields	f;
 
-  cJSON * const json = cJSON_Parse(text);
-  if ( json == NULL ) {
-    std::cerr << "JSON could not parse command \"" << text << "\"" << std::endl;
+  if ( json_scan_object(text, length, command_member, &f) != 0 ) {
+    std::cerr << "JSON could not parse command \"";
+    std::cerr.write(text, length) << "\"" << std::endl;
     return 1;
   }
-  const char * const command = cJSON_GetObjectItem(json,"command")->valuestring;
   int value = 0;
 
-  std::cerr << "Command: " << command << std::endl;
+  std::cerr << "Command: " << f.command << std::endl;
   while ( c->name != 0 ) {
-    if ( strcmp(command, c->name) == 0 ) {
-      value = c->function(command, json, client);
+    if ( strcmp(f.command, c->name) == 0 ) {
+      value = c->function(f.command, &f.settings, client);
       break;
     }
     c++;
   }
-  cJSON_Delete(json);
   return value;
 }
 
+// libwebsockets doesn't promise to drain a socket each time it is
+// serviced, so its descriptors stay level triggered.
+class websocket_poll_handler : public poll_handler {
+private:
+  libwebsocket_context * const	context;
+
+public:
+  websocket_poll_handler(libwebsocket_context * c) : context(c) {}
+
+  void		ready(int fd, unsigned int revents) {
+		  pollfd pfd;
+		  pfd.fd = fd;
+		  pfd.events = 0;
+		  pfd.revents = revents;
+		  libwebsocket_service_fd(context, &pfd);
+		}
+};
+
+static websocket_poll_handler *	websocket_handler = 0;
+
 static void
 monitor_poll_fd(
  libwebsocket_context *         context,
@@ -644,7 +1267,9 @@ monitor_poll_fd(
   case LWS_CALLBACK_UNLOCK_POLL:
     return;
   case LWS_CALLBACK_ADD_POLL_FD:
-    poll_start_fd(context, args->fd, args->events, -1);
+    if ( !websocket_handler )
+      websocket_handler = new websocket_poll_handler(context);
+    poll_start_fd(args->fd, args->events, websocket_handler);
     break;
   case LWS_CALLBACK_CHANGE_MODE_POLL_FD:
     poll_change_fd(args->fd, args->events);
@@ -658,10 +1283,10 @@ monitor_poll_fd(
 }
 
 static int
-receive(const char *, cJSON *, client_context * client)
+receive(const char *, const radio_settings *, client_context * client)
 {
   radio_receive(client->radio, &client->info);
-  send_status(client);
+  server_status_changed();
   return 0;
 }
 
@@ -671,24 +1296,115 @@ server_end(libwebsocket_context * context)
   libwebsocket_context_destroy(context);
 }
 
+// Takes the first queued buffer of the given type off the client's queue
+// and releases it.  Returns false if there was none.
+static bool
+drop_queued(client_context * client, uint32_t type)
+{
+  const unsigned int	size = client->queue_size;
+  WriteBuffer * * const	q = client->queue;
+
+  for ( unsigned int i = 0; i < client->queued; i++ ) {
+    const unsigned int	at = (client->queue_head + i) % size;
+
+    if ( q[at]->type() != type )
+      continue;
+    q[at]->release();
+
+    // Close the gap, keeping the rest in order.
+    for ( unsigned int j = i + 1; j < client->queued; j++ )
+      q[(client->queue_head + j - 1) % size] = q[(client->queue_head + j) % size];
+    client->queued--;
+    client->dropped++;
+    return true;
+  }
+  return false;
+}
+
+// Takes effect for clients that connect afterward.
+void
+server_set_queue_depth(unsigned int depth)
+{
+  queue_depth = depth > 0 ? depth : 1;
+}
+
+void
+server_set_send_policy(uint32_t type, send_policy policy)
+{
+  if ( type < SERVER_FRAME_TYPES )
+    send_policies[type] = policy;
+}
+
+bool
+server_congested(client_context * client)
+{
+  return client->queued * 2 >= client->queue_size;
+}
+
 void
 server_data_out(client_context * client, WriteBuffer * buffer)
 {
-  if ( client->last_buffer ) {
-    client->last_buffer->link(buffer);
-    client->last_buffer = buffer;
+  const uint32_t	type = buffer->type();
+  const send_policy	policy = type < SERVER_FRAME_TYPES
+			 ? send_policies[type] : SEND_DROP_NEWEST;
+
+  if ( policy == SEND_COALESCE ) {
+    while ( drop_queued(client, type) )
+      ;
   }
-  else {
-    client->buffers = client->last_buffer = buffer;
+  if ( client->queued >= client->queue_size
+   && !(policy == SEND_DROP_OLDEST && drop_queued(client, type)) ) {
+    buffer->release();
+    client->dropped++;
+    return;
   }
 
+  client->queue[(client->queue_head + client->queued) % client->queue_size]
+   = buffer;
+  client->queued++;
+  if ( client->queued > client->queue_high_water )
+    client->queue_high_water = client->queued;
+
   libwebsocket_callback_on_writable(client->websocket_context, client->wsi);
 }
 
+unsigned int
+server_queued(client_context * client)
+{
+  return client->queued;
+}
+
+// Queues buffer to every open client with fewer than max_queued buffers
+// waiting, and lets go of the caller's reference.
+static void
+broadcast(WriteBuffer * buffer, unsigned int max_queued)
+{
+  for ( client_context * c = clients; c; c = c->next_client ) {
+    if ( !c->open || c->queued >= max_queued )
+      continue;
+    buffer->hold();
+    server_data_out(c, buffer);
+  }
+  buffer->release();
+}
+
 void
-server_service_fd(libwebsocket_context * context, pollfd * pfd)
+server_broadcast(
+ uint32_t		type,
+ const void *		data,
+ size_t			length,
+ unsigned int		max_queued)
 {
-  libwebsocket_service_fd(context, pfd);
+  client_context *	c = clients;
+
+  while ( c && (!c->open || c->queued >= max_queued) )
+    c = c->next_client;
+  if ( !c )
+    return;
+
+  WriteBuffer * const	buffer = new WriteBuffer(length, type);
+  memcpy(buffer->data(), data, length);
+  broadcast(buffer, max_queued);
 }
 
 libwebsocket_context *
@@ -716,6 +1432,9 @@ server_start(const char * device, int port, bool use_ssl)
 
   lws_context_creation_info http_port;
 
+  if ( web_cache.empty() )
+    web_cache_load(LIB_DIR PROGRAM_NAME "web_content/");
+
   libwebsocket_protocols * p = new libwebsocket_protocols[sizeof(protocols)/sizeof(*protocols)];
   memcpy(p, protocols, sizeof(protocols));
   memset(&http_port, 0, sizeof(http_port));
@@ -757,39 +1476,162 @@ server_start(const char * device, int port, bool use_ssl)
   return libwebsocket_create_context(&http_port);
 }
 
+static int
+scan(
+ const char *           , // command
+ const radio_settings * settings,
+ client_context *       client)
+{
+  if ( radio_scan(client->radio, &client->info, settings) != 0 )
+    std::cerr << "scan needs start <= stop, a step and a dwell" << std::endl;
+  return 0;
+}
+
 static int
 set(
  const char *           , // command
- cJSON *                json,
+ const radio_settings * settings,
  client_context *       client)
 {
-  radio_set(client->radio, &client->info, json);
-  send_status(client);
+  radio_set(client->radio, &client->info, settings);
+  server_status_changed();
   return 0;
 }
 
-// Send the current status of the radio to the client.
+// Where send_status() starts; the pool class that usually fits.
+#define STATUS_BUFFER_SIZE	1024
+
+// Send the current status of the radio to every client.  It is written
+// straight into a pooled WriteBuffer, which is retried larger if the
+// status outgrows it.
 static void
-send_status(client_context * client)
+send_status()
+{
+  if ( !clients )
+    return;
+
+  size_t	size = STATUS_BUFFER_SIZE;
+
+  for ( ; ; ) {
+    WriteBuffer * const	buffer = new WriteBuffer(size, 0);
+    json_writer		json;
+
+    json_writer_init(&json, (char *)buffer->data(), size);
+    json_object_begin(&json, 0);
+    radio_get_status(0, 0, &json);
+
+    write_buffer_stats	stats[WRITE_BUFFER_CLASSES];
+    unsigned long	oversize;
+    int			high_water[WRITE_BUFFER_CLASSES];
+    int			misses[WRITE_BUFFER_CLASSES];
+
+    write_buffer_pool_stats(stats, &oversize);
+    for ( int i = 0; i < WRITE_BUFFER_CLASSES; i++ ) {
+      high_water[i] = stats[i].high_water;
+      misses[i] = stats[i].misses;
+    }
+    json_write_int_array(&json, "pool_high_water", high_water, WRITE_BUFFER_CLASSES);
+    json_write_int_array(&json, "pool_misses", misses, WRITE_BUFFER_CLASSES);
+    json_write_long(&json, "pool_oversize", oversize);
+
+    // Each client's queue, so one status serves them all.
+    json_array_begin(&json, "clients");
+    for ( client_context * c = clients; c; c = c->next_client ) {
+      json_object_begin(&json, 0);
+      json_write_string(&json, "ip_address", c->info.ip_address);
+      json_write_long(&json, "queued", c->queued);
+      json_write_long(&json, "queue_high_water", c->queue_high_water);
+      json_write_long(&json, "queue_dropped", c->dropped);
+      json_object_end(&json);
+    }
+    json_array_end(&json);
+    json_object_end(&json);
+
+    if ( !json_writer_overflowed(&json) ) {
+      buffer->length(json_writer_length(&json));
+      broadcast(buffer, ~0U);
+      return;
+    }
+    buffer->release();
+    size *= 2;
+  }
+}
+
+// Paces send_status().  The first change after a quiet interval goes out
+// at once; later ones set the timer and go out together when it fires.
+class status_timer : public poll_handler {
+private:
+  int		fd;
+  bool		armed;
+  struct timeval	last_sent;
+
+public:
+  status_timer() : fd(-1), armed(false) {
+		  timerclear(&last_sent);
+		  fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		  if ( fd >= 0 )
+		    poll_start_fd(fd, POLLIN, this);
+		  else
+		    perror("status timerfd_create");
+		}
+
+  void		send() {
+		  armed = false;
+		  gettimeofday(&last_sent, 0);
+		  send_status();
+		}
+
+  void		changed() {
+		  if ( armed )
+		    return;
+
+		  struct timeval now, since;
+		  gettimeofday(&now, 0);
+		  timersub(&now, &last_sent, &since);
+		  const long elapsed_us = since.tv_sec * 1000000L + since.tv_usec;
+		  const long interval_us = STATUS_INTERVAL_MS * 1000L;
+
+		  if ( fd < 0 || elapsed_us < 0 || elapsed_us >= interval_us ) {
+		    send();
+		    return;
+		  }
+
+		  itimerspec t;
+		  memset(&t, 0, sizeof(t));
+		  t.it_value.tv_nsec = (interval_us - elapsed_us) * 1000L;
+		  if ( timerfd_settime(fd, 0, &t, 0) < 0 ) {
+		    perror("status timerfd_settime");
+		    send();
+		    return;
+		  }
+		  armed = true;
+		}
+
+  void		ready(int, unsigned int) {
+		  uint64_t expirations;
+		  if ( read(fd, &expirations, sizeof(expirations)) < 0 )
+		    return;
+		  send();
+		}
+};
+
+void
+server_status_changed()
 {
+  static status_timer *	timer = 0;
 
-  cJSON * const json = cJSON_CreateObject();    
-  radio_get_status(client->radio, &client->info, json);
-  char * text = cJSON_Print(json);
-  WriteBuffer * buffer = new WriteBuffer(strlen(text), 0);
-  strcpy((char *)buffer->data(), text);
-  free(text);
-  cJSON_Delete(json);
-  server_data_out(client, buffer);
+  if ( !timer )
+    timer = new status_timer();
+  timer->changed();
 }
 
 static int
 transmit(
  const char *,
- cJSON *,
+ const radio_settings *,
  client_context * client)
 {
   radio_transmit(client->radio, &client->info);
-  send_status(client);
+  server_status_changed();
   return 0;
 }
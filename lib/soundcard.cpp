@@ -4,6 +4,7 @@
 
 char *device = 0;
 unsigned int rate = 48000;
+unsigned int stream_rate = 48000;
 unsigned int playback_channels = 2;
 unsigned int capture_channels = 1;
 unsigned int buffer_time = 500000;
@@ -146,9 +147,18 @@ int playback_transfer(
         samples[chn] += offset * steps[chn];
     }
 
+    // Pull exactly enough stream samples to resample into one period.
+    int need = resampler_input_needed(&playback->resampler, size);
+    int got = source(playback->stream, need);
+    if (got < need)
+        memset(&playback->stream[got], 0, (need - got) * sizeof(int16_t));
+    resample16(&playback->resampler, playback->stream, need,
+        playback->resampled, size, 0);
+    int16_t *next = playback->resampled;
+
     // Fill in the buffer from the source.
     while (size-- > 0) {
-        res = (int)source();
+        res = (int)*next++;
 
         for (chn = 0; chn < playback_channels; ++chn) {
             for (i = 0; i < bps; ++i)
@@ -235,6 +245,7 @@ int capture_transfer(
     }
 
     // Fill in the sink buffer; only use the first mic channel for now;
+    int16_t *next = capture->stream;
     while (size-- > 0) {
         res = 0;
         for (i = 0; i < bps; ++i) {
@@ -242,7 +253,7 @@ int capture_transfer(
         }
         samples[0] += steps[0];
         
-        sink((int16_t)res);
+        *next++ = (int16_t)res;
         
         for (chn = 1; chn < capture_channels; ++chn) {
             for (i = 0; i < bps; ++i)
@@ -250,6 +261,12 @@ int capture_transfer(
             samples[chn] += steps[chn];
         }
     }
+
+    // Bring the period up to the stream rate and hand it to the sink.
+    int count = resample16(&capture->resampler, capture->stream, period_size,
+        capture->resampled, (period_size * capture->resampler.l) /
+        capture->resampler.m + 2, 0);
+    sink(capture->resampled, count);
 }
 
 
@@ -290,11 +307,27 @@ void *playback_init() {
         playback->areas[chn].first = chn * snd_pcm_format_physical_width(format);
         playback->areas[chn].step = playback_channels * snd_pcm_format_physical_width(format);
     }
+
+    // The configured rate may have moved to the nearest the card supports.
+    if (resampler_init(&playback->resampler, stream_rate, rate) < 0) {
+        //fprintf(stderr, "Can't resample %d to %d\n", stream_rate, rate);
+        return NULL;
+    }
+
+    playback->resampled = (int16_t*)malloc(period_size * sizeof(int16_t));
+    playback->stream = (int16_t*)malloc(((period_size * playback->resampler.m) /
+            playback->resampler.l + 2) * sizeof(int16_t));
+    if (playback->resampled == NULL || playback->stream == NULL) {
+        //fprintf(stderr, "3not enough memory\n");
+        return NULL;
+    }
     return playback;
 }
 
 void playback_close(void *data) {
     struct playback *playback = (struct playback *)data;
+    free(playback->stream);
+    free(playback->resampled);
     free(playback->areas);
     free(playback->samples);
     snd_pcm_close(playback->handle);
@@ -365,6 +398,19 @@ void *capture_init() {
         capture->areas[chn].step = capture_channels * snd_pcm_format_physical_width(format);
     }
 
+    if (resampler_init(&capture->resampler, rate, stream_rate) < 0) {
+        //fprintf(stderr, "Can't resample %d to %d\n", rate, stream_rate);
+        return NULL;
+    }
+
+    capture->stream = (int16_t*)malloc(period_size * sizeof(int16_t));
+    capture->resampled = (int16_t*)malloc(((period_size * capture->resampler.l) /
+            capture->resampler.m + 2) * sizeof(int16_t));
+    if (capture->stream == NULL || capture->resampled == NULL) {
+        //fprintf(stderr, "3not enough memory\n");
+        return NULL;
+    }
+
     if ((err = snd_pcm_start(capture->handle)) < 0) {
         //fprintf(stderr, "cannot start mic interface (%s)\n",
         //    snd_strerror(err));
@@ -376,6 +422,8 @@ void *capture_init() {
 
 void capture_close(void *data) {
     struct capture *capture = (struct capture *)data;
+    free(capture->stream);
+    free(capture->resampled);
     free(capture->areas);
     free(capture->samples);
     snd_pcm_close(capture->handle);
@@ -6,24 +6,34 @@ extern "C" {
 #endif
 
 #include "resources.h"
+#include "dsp.h"
 
 extern char *device;
 extern unsigned int rate;
+extern unsigned int stream_rate;
 extern unsigned int playback_channels;
 extern unsigned int capture_channels;
 extern unsigned int buffer_time;
 extern unsigned int period_time;
 
+// The soundcard runs at rate, while source() and sink() run at stream_rate;
+// each direction carries its own resampler between the two.
 struct playback {
     snd_pcm_t *handle;
     int16_t *samples;
     snd_pcm_channel_area_t *areas;
+    struct resampler resampler;
+    int16_t *stream;
+    int16_t *resampled;
 };
 
 struct capture {
     snd_pcm_t *handle;
     int16_t *samples;
     snd_pcm_channel_area_t *areas;
+    struct resampler resampler;
+    int16_t *stream;
+    int16_t *resampled;
 };
 
 void *playback_init();
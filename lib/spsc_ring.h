@@ -0,0 +1,180 @@
+#ifndef __SPSC_RING_H__
+#define __SPSC_RING_H__
+
+#include <stddef.h>
+#include <string.h>
+
+#if __cplusplus >= 201103L
+#include <atomic>
+#endif
+
+// Single producer, single consumer ring of N elements, N a power of two.
+//
+// The producer only ever writes head and the consumer only ever writes
+// tail.  Both count up without wrapping at N, so head - tail is the fill
+// and the whole ring can be used.  Each side keeps its index and its
+// telemetry on a cache line of its own, aligned so that neither shares one
+// with the other side or with whatever is next to the ring.
+//
+// write_block()/read_block() hand out the largest contiguous region that
+// can be written or read in place; write_commit()/read_commit() publish it.
+// write()/read() copy through those for callers that have their own buffer.
+
+#define SPSC_RING_CACHE_LINE 64
+#define SPSC_RING_ALIGNED __attribute__((aligned(SPSC_RING_CACHE_LINE)))
+
+#if __cplusplus >= 201103L
+typedef std::atomic<size_t>	spsc_index;
+
+static inline size_t spsc_load_acquire(const spsc_index & i)
+{
+  return i.load(std::memory_order_acquire);
+}
+
+static inline void spsc_store_release(spsc_index & i, size_t v)
+{
+  i.store(v, std::memory_order_release);
+}
+#else
+// The cross toolchain predates <atomic>, so order by hand.  Cortex-M3 needs
+// a DMB between the data and the index it guards; elsewhere a full barrier.
+typedef volatile size_t		spsc_index;
+
+static inline void spsc_barrier()
+{
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7A__)
+  __asm__ __volatile__ ("dmb" ::: "memory");
+#else
+  __sync_synchronize();
+#endif
+}
+
+static inline size_t spsc_load_acquire(const spsc_index & i)
+{
+  const size_t v = i;
+  spsc_barrier();
+  return v;
+}
+
+static inline void spsc_store_release(spsc_index & i, size_t v)
+{
+  spsc_barrier();
+  i = v;
+}
+#endif
+
+template <typename T>
+struct spsc_span {
+  T *		data;
+  size_t	length;
+};
+
+template <typename T, size_t N>
+class spsc_ring {
+private:
+  // Producer side.
+  spsc_index		head SPSC_RING_ALIGNED;
+  size_t		high_water;
+  unsigned long		overflows;
+
+  // Consumer side.
+  spsc_index		tail SPSC_RING_ALIGNED;
+  unsigned long		underflows;
+
+  T			storage[N] SPSC_RING_ALIGNED;
+
+  typedef char		n_must_be_a_power_of_two[(N & (N - 1)) == 0 ? 1 : -1];
+
+  spsc_ring(const spsc_ring &);
+  spsc_ring &		operator =(const spsc_ring &);
+
+public:
+  spsc_ring() : head(0), high_water(0), overflows(0), tail(0), underflows(0) {
+  }
+
+  inline size_t		capacity() const { return N; }
+
+  // Elements waiting to be read. Exact from either side, a snapshot from
+  // anywhere else.
+  inline size_t		fill() const {
+			  return spsc_load_acquire(head) - spsc_load_acquire(tail);
+			}
+
+  // Telemetry: the highest fill seen by the producer, and the number of
+  // elements write() and read() could not move.
+  inline size_t		max_fill() const { return high_water; }
+  inline unsigned long	overflow_count() const { return overflows; }
+  inline unsigned long	underflow_count() const { return underflows; }
+
+  // Producer: contiguous space starting at the head.
+  spsc_span<T>		write_block() {
+			  const size_t h = head;
+			  const size_t space = N - (h - spsc_load_acquire(tail));
+			  const size_t offset = h & (N - 1);
+			  spsc_span<T> s;
+			  s.data = &storage[offset];
+			  s.length = space < N - offset ? space : N - offset;
+			  return s;
+			}
+
+  void			write_commit(size_t n) {
+			  const size_t h = head + n;
+			  spsc_store_release(head, h);
+			  const size_t f = h - spsc_load_acquire(tail);
+			  if ( f > high_water )
+			    high_water = f;
+			}
+
+  // Consumer: contiguous data starting at the tail.
+  spsc_span<const T>	read_block() {
+			  const size_t t = tail;
+			  const size_t data = spsc_load_acquire(head) - t;
+			  const size_t offset = t & (N - 1);
+			  spsc_span<const T> s;
+			  s.data = &storage[offset];
+			  s.length = data < N - offset ? data : N - offset;
+			  return s;
+			}
+
+  void			read_commit(size_t n) {
+			  spsc_store_release(tail, tail + n);
+			}
+
+  // Copies as much of src as fits and returns the count; the rest is
+  // counted as overflow.
+  size_t		write(const T * src, size_t n) {
+			  size_t done = 0;
+			  while ( done < n ) {
+			    spsc_span<T> s = write_block();
+			    if ( s.length == 0 )
+			      break;
+			    if ( s.length > n - done )
+			      s.length = n - done;
+			    memcpy(s.data, &src[done], s.length * sizeof(T));
+			    write_commit(s.length);
+			    done += s.length;
+			  }
+			  overflows += n - done;
+			  return done;
+			}
+
+  // Copies up to n elements into dst and returns the count; the shortfall
+  // is counted as underflow.
+  size_t		read(T * dst, size_t n) {
+			  size_t done = 0;
+			  while ( done < n ) {
+			    spsc_span<const T> s = read_block();
+			    if ( s.length == 0 )
+			      break;
+			    if ( s.length > n - done )
+			      s.length = n - done;
+			    memcpy(&dst[done], s.data, s.length * sizeof(T));
+			    read_commit(s.length);
+			    done += s.length;
+			  }
+			  underflows += n - done;
+			  return done;
+			}
+};
+
+#endif /* __SPSC_RING_H__ */
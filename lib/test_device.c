@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
@@ -117,6 +118,150 @@ int test_ioctl_receiver(void *data) {
     return 0;
 }
 
+int test_transaction(void *data) {
+    int fd;
+    int16_t ic, qc;
+    float ig, qg;
+    uint16_t aeval, afval;
+
+    whitebox_t wb;
+    whitebox_args_t w;
+    whitebox_init(&wb);
+    assert((fd = whitebox_open(&wb, "/dev/whitebox", O_RDWR, SAMPLE_RATE)) > 0);
+
+    // Nothing reaches the device until the outermost commit.
+    whitebox_begin(&wb);
+    assert(whitebox_tx_set_interp(&wb, 64) == 0);
+    whitebox_tx_set_correction(&wb, -5, 7);
+    whitebox_begin(&wb);
+    assert(whitebox_tx_set_gain(&wb, 0.5, 1.5) == 0);
+    assert(whitebox_tx_set_buffer_threshold(&wb, 100, 900) == 0);
+    assert(whitebox_rx_set_decim(&wb, 64) == 0);
+    assert(whitebox_commit(&wb) == 0);
+    assert(ioctl(fd, WE_GET, &w) == 0);
+    assert((w.flags.exciter.interp & 0xffff) != 64);
+
+    // The getters answer from the shadow meanwhile.
+    whitebox_tx_get_correction(&wb, &ic, &qc);
+    assert(ic == -5 && qc == 7);
+
+    assert(whitebox_commit(&wb) == 0);
+    assert(ioctl(fd, WE_GET, &w) == 0);
+    assert((w.flags.exciter.interp & 0xffff) == 64);
+    assert(w.flags.exciter.threshold == (100 | (900 << WET_AFVAL_OFFSET)));
+    assert(ioctl(fd, WR_GET, &w) == 0);
+    assert(w.flags.receiver.decim == 64);
+
+    // Fields the transaction didn't touch are left alone.
+    assert(ioctl(fd, WE_GET, &w) == 0);
+    w.flags.exciter.fcw = 32;
+    assert(ioctl(fd, WE_SET, &w) == 0);
+    whitebox_tx_set_correction(&wb, 3, -3);
+    assert(ioctl(fd, WE_GET, &w) == 0);
+    assert(w.flags.exciter.fcw == 32);
+
+    whitebox_tx_get_gain(&wb, &ig, &qg);
+    assert(ig == 0.5 && qg == 1.5);
+    whitebox_tx_get_buffer_threshold(&wb, &aeval, &afval);
+    assert(aeval == 100 && afval == 900);
+
+    assert(whitebox_close(&wb) == 0);
+    return 0;
+}
+
+int test_params(void *data) {
+    whitebox_t wb;
+    int threshold;
+    whitebox_init(&wb);
+    assert(whitebox_open(&wb, "/dev/whitebox", O_RDWR, SAMPLE_RATE) > 0);
+
+    // The ioctl and sysfs see the same variable.
+    threshold = whitebox_param_get(&wb, WP_USER_SINK_BUFFER_THRESHOLD);
+    assert(threshold == whitebox_parameter_get("user_sink_buffer_threshold"));
+    assert(whitebox_param_set(&wb, WP_USER_SINK_BUFFER_THRESHOLD, 1234) == 0);
+    assert(whitebox_parameter_get("user_sink_buffer_threshold") == 1234);
+    assert(whitebox_parameter_set("user_sink_buffer_threshold", threshold) == 0);
+    assert(whitebox_param_get(&wb, WP_USER_SINK_BUFFER_THRESHOLD) == threshold);
+
+    assert(whitebox_param_get(&wb, WP_USER_ORDER)
+            == whitebox_parameter_get("user_order"));
+    assert(whitebox_param_get(&wb, WP_COUNT) == -1 && errno == EINVAL);
+    assert(whitebox_param_set(&wb, WP_COUNT, 0) == -1 && errno == EINVAL);
+
+    // The driver turns away a bad value, and sysfs isn't tried instead.
+    assert(whitebox_param_set(&wb, WP_FRAME_SIZE, 0) == -1 && errno == ERANGE);
+    assert(whitebox_param_get(&wb, WP_FRAME_SIZE) > 0);
+
+    assert(whitebox_close(&wb) == 0);
+    return 0;
+}
+
+int test_channel_plan(void *data) {
+    static const float plan[] = { 145.5e6, 145.525e6, 146.52e6 };
+    whitebox_t wb;
+    whitebox_args_t w;
+    adf4351_t adf4351;
+    unsigned lock_us;
+    int fd, i;
+    whitebox_init(&wb);
+    assert(whitebox_channel_plan(&wb, plan, 3) == 0);
+    assert(wb.synth_count == 3);
+    assert((fd = whitebox_open(&wb, "/dev/whitebox", O_RDWR, SAMPLE_RATE)) > 0);
+
+    // Each planned channel loads what a fresh calculation would.
+    for (i = 0; i < 3; ++i) {
+        assert(whitebox_rx(&wb, plan[i]) == 0);
+        assert(ioctl(fd, WA_GET, &w) == 0);
+        assert(memcmp(w.flags.adf4351, wb.synth[i].adf4351,
+                sizeof(wb.synth[i].adf4351)) == 0);
+        adf4351_init(&adf4351);
+        adf4351_pll_enable(&adf4351, WA_CLOCK_RATE, 8e3,
+                (plan[i] + 45.00e6) * 4.0);
+        assert(adf4351_pack(&adf4351, 0) == w.flags.adf4351[0]);
+        assert(adf4351_pack(&adf4351, 1) == w.flags.adf4351[1]);
+        assert(whitebox_plls_wait_locked(&wb, 10000, &lock_us) == 1);
+        printf("%.3f MHz locked in %u us\n", plan[i] / 1e6, lock_us);
+    }
+
+    // A channel outside the plan is cached on first use.
+    assert(whitebox_rx_fine_tune(&wb, 146.0e6) == 0);
+    assert(wb.synth_count == 4);
+    assert(whitebox_rx_fine_tune(&wb, 146.0e6) == 0);
+    assert(wb.synth_count == 4);
+    assert(whitebox_plls_locked(&wb));
+
+    assert(whitebox_close(&wb) == 0);
+    return 0;
+}
+
+int test_scan(void *data) {
+    whitebox_t wb;
+    whitebox_scan_channel_t channels[20];
+    float rate;
+    int i;
+    whitebox_init(&wb);
+    assert(whitebox_open(&wb, "/dev/whitebox", O_RDWR, SAMPLE_RATE) > 0);
+    assert(whitebox_mmap(&wb) == 0);
+
+    for (i = 0; i < 20; ++i)
+        channels[i].frequency = 146.52e6 + i * 25e3;
+    assert(whitebox_scan(&wb, channels, 20, 0) < 0);
+    // Twice: the second time round every channel is in the cache.
+    assert(whitebox_scan(&wb, channels, 20, SAMPLE_RATE / 1000) > 0);
+    assert((rate = whitebox_scan(&wb, channels, 20, SAMPLE_RATE / 1000)) > 0);
+    printf("%.1f channels/s\n", rate);
+    for (i = 0; i < 20; ++i) {
+        assert(channels[i].locked);
+        assert(channels[i].rssi <= 0.1);
+        printf("%.3f MHz %5.1f dBFS lock %u us\n", channels[i].frequency / 1e6,
+                channels[i].rssi, channels[i].lock_us);
+    }
+
+    assert(whitebox_munmap(&wb) == 0);
+    assert(whitebox_close(&wb) == 0);
+    return 0;
+}
+
 int test_tx_fifo(void *data) {
     int fd;
     int ret;
@@ -431,6 +576,10 @@ int main(int argc, char **argv) {
         WHITEBOX_TEST(test_rx_clear),
         WHITEBOX_TEST(test_ioctl_exciter),
         WHITEBOX_TEST(test_ioctl_receiver),
+        WHITEBOX_TEST(test_transaction),
+        WHITEBOX_TEST(test_params),
+        WHITEBOX_TEST(test_channel_plan),
+        WHITEBOX_TEST(test_scan),
         WHITEBOX_TEST(test_tx_overrun_underrun),
         WHITEBOX_TEST(test_tx_halt),
 #if 0
@@ -87,6 +87,18 @@ int test_ioctl_not_locked(void *data) {
     return 0;
 }
 
+int test_ioctl_wait_locked_timeout(void *data) {
+    int fd;
+    whitebox_lock_wait_t l;
+    fd = open(WHITEBOX_DEV, O_WRONLY);
+    assert(fd > 0);
+    l.timeout_us = 2000;
+    assert(ioctl(fd, W_WAIT_LOCKED, &l) < 0 && errno == ETIMEDOUT);
+    assert(l.elapsed_us >= 2000 && l.elapsed_us < 20000);
+    close(fd);
+    return 0;
+}
+
 int test_ioctl_exciter(void *data) {
     int fd;
     whitebox_args_t w;
@@ -598,6 +610,7 @@ int main(int argc, char **argv) {
         WHITEBOX_TEST(test_blocking_xfer4),
         WHITEBOX_TEST(test_ioctl_reset),
         WHITEBOX_TEST(test_ioctl_not_locked),
+        WHITEBOX_TEST(test_ioctl_wait_locked_timeout),
         WHITEBOX_TEST(test_ioctl_exciter),
         WHITEBOX_TEST(test_ioctl_fir),
         //WHITEBOX_TEST(test_ioctl_cmx991),
@@ -1,4 +1,7 @@
 #include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
 #include "whitebox.h"
 #include "whitebox_test.h"
 #include "dsp.h"
@@ -16,6 +19,397 @@ int test_sincos16(void* data) {
     return 0;
 }
 
+int test_sincos16c_block(void* data) {
+    unsigned int j;
+    uint32_t phase = 0, block_phase = 0;
+    uint32_t fcw = freq_to_fcw(2000, SAMPLE_RATE);
+    uint32_t iq[37];
+    // Uneven block sizes exercise the phase carried between calls.
+    for (j = 0; j < 7; ++j) {
+        int k, n = 37 - j * 5;
+        sincos16c_block(fcw, &block_phase, iq, n);
+        for (k = 0; k < n; ++k) {
+            int16_t i, q;
+            sincos16(fcw, &phase, &i, &q);
+            assert(iq[k] == QUAD_PACK(i, -q));
+        }
+        assert(phase == block_phase);
+    }
+    return 0;
+}
+
+int test_cos16_block(void* data) {
+    unsigned int j;
+    uint32_t phase = 0, block_phase = 0;
+    uint32_t fcw = freq_to_fcw(400, SAMPLE_RATE);
+    int16_t s[29];
+    for (j = 0; j < 11; ++j) {
+        int k;
+        cos16_block(fcw, &block_phase, s, 29);
+        for (k = 0; k < 29; ++k) {
+            int16_t i, q;
+            sincos16(fcw, &phase, &i, &q);
+            assert(s[k] == i);
+        }
+    }
+    assert(phase == block_phase);
+    return 0;
+}
+
+int _test_resample(int in_rate, int out_rate) {
+    struct resampler r;
+    int16_t in[4096], out[4096];
+    uint32_t phase = 0;
+    uint32_t fcw = freq_to_fcw(1000, in_rate);
+    int total_in = 0, total_out = 0, block, peak = 0;
+
+    assert(resampler_init(&r, in_rate, out_rate) == 0);
+
+    // Push mode: every input sample is consumed.
+    for (block = 0; block < 50; ++block) {
+        int k, used, n;
+        cos16_block(fcw, &phase, in, 480);
+        n = resample16(&r, in, 480, out, 4096, &used);
+        assert(used == 480);
+        total_in += used;
+        total_out += n;
+        for (k = 0; block > 2 && k < n; ++k)
+            peak = out[k] > peak ? out[k] : peak;
+    }
+    assert(abs(total_out - (int)((long long)total_in * out_rate / in_rate)) <= 1);
+    assert(abs(peak - 32767) < 32767 / 20);
+
+    // Pull mode: ask for exactly what is needed for a fixed output block.
+    for (block = 0; block < 50; ++block) {
+        int used, n, need = resampler_input_needed(&r, 441);
+        assert(need <= 4096);
+        cos16_block(fcw, &phase, in, need);
+        n = resample16(&r, in, need, out, 441, &used);
+        assert(n == 441);
+        assert(used == need);
+    }
+    return 0;
+}
+
+// Output power of a full scale tone at freq through in_rate to out_rate,
+// in dB, once the filter has filled.
+static float resampled_tone_db(int in_rate, int out_rate, float freq) {
+    static struct resampler r;
+    int16_t in[1000], out[1000];
+    uint32_t phase = 0;
+    uint32_t fcw = freq_to_fcw(freq, in_rate);
+    double energy = 0;
+    int block, k, n, count = 0;
+
+    assert(resampler_init(&r, in_rate, out_rate) == 0);
+    for (block = 0; block < 40; ++block) {
+        cos16_block(fcw, &phase, in, 1000);
+        n = resample16(&r, in, 1000, out, 1000, NULL);
+        for (k = 0; block >= 4 && k < n; ++k) {
+            energy += (double)out[k] * out[k];
+            count++;
+        }
+    }
+    return 10 * log10(energy / count / (32767. * 32767. / 2));
+}
+
+int test_resample_stopband(void* data) {
+    static const float stop[] = { 4800, 5500, 7000, 9000, 12500, 16000, 20000, 24000, 0 };
+    int i;
+    // The receive audio path: only the voice band may come through, and
+    // nothing above the output Nyquist may alias back into it.
+    assert(fabs(resampled_tone_db(50000, 8192, 1000)) < 0.5);
+    assert(fabs(resampled_tone_db(50000, 8192, 2500)) < 1);
+    for (i = 0; stop[i]; ++i)
+        assert(resampled_tone_db(50000, 8192, stop[i]) < -55);
+    // The sound card path, close to 1:1, is unchanged.
+    assert(fabs(resampled_tone_db(48000, 50000, 1000)) < 0.5);
+    return 0;
+}
+
+int test_resample(void* data) {
+    _test_resample(48000, 50000);
+    _test_resample(50000, 48000);
+    _test_resample(50000, 8192);
+    _test_resample(8192, 50000);
+    return 0;
+}
+
+int test_atan2_16(void* data) {
+    int k;
+    for (k = 0; k < 360; ++k) {
+        double a = k * M_PI / 180.;
+        int32_t x = (int32_t)(cos(a) * 1e6), y = (int32_t)(sin(a) * 1e6);
+        int16_t expected = (int16_t)(int32_t)lround(a / M_PI * 32768.);
+        assert(abs((int16_t)(atan2_16(y, x) - expected)) < 48);
+        assert(abs((int16_t)(atan2_16(y >> 8, x >> 8) - expected)) < 48);
+    }
+    assert(atan2_16(0, 0) == 0);
+    return 0;
+}
+
+int test_fm_loopback(void* data) {
+    struct fm_modulator mod;
+    struct fm_demodulator demod;
+    int16_t sensitivity = (int16_t)(2. * M_PI * 5e3 / 50000. * 32767);
+    uint32_t phase = 0, fcw = freq_to_fcw(1000, 50000);
+    int16_t audio[250], out[250];
+    uint32_t iq[250];
+    int j, k;
+    double power = 0., error = 0.;
+    fm_modulator_init(&mod, sensitivity);
+    fm_demodulator_init(&demod, sensitivity);
+    for (j = 0; j < 40; ++j) {
+        cos16_block(fcw, &phase, audio, 250);
+        for (k = 0; k < 250; ++k)
+            audio[k] >>= 2;
+        fm_mod_block(&mod, audio, iq, 250);
+        fm_demod_block(&demod, iq, out, 250);
+        // Let the DC blocker settle before comparing.
+        if (j < 20)
+            continue;
+        for (k = 0; k < 250; ++k) {
+            power += (double)audio[k] * audio[k];
+            error += ((double)audio[k] - out[k]) * (audio[k] - out[k]);
+        }
+    }
+    // Better than 20dB SNR through the modulator and discriminator.
+    assert(error * 100. < power);
+    return 0;
+}
+
+int test_hilbert(void* data) {
+    struct hilbert h;
+    uint32_t phase = 0, fcw = freq_to_fcw(1000, 50000);
+    uint32_t iq[200];
+    int16_t in[200], delayed[200], out[200];
+    int j, k;
+    hilbert_init(&h);
+    for (j = 0; j < 4; ++j) {
+        sincos16c_block(fcw, &phase, iq, 200);
+        // Only the I half goes in.
+        for (k = 0; k < 200; ++k)
+            in[k] = (int16_t)(iq[k] & 0xffffUL) >> 1;
+        hilbert_block(&h, in, delayed, out, 200);
+    }
+    // cos in, delayed cos and sin out.
+    for (k = 0; k < 200; ++k) {
+        int16_t i, q;
+        QUAD_UNPACK(iq[(k + 200 - HILBERT_DELAY) % 200], i, q);
+        assert(delayed[k] == i >> 1);
+        assert(abs(out[k] - (q >> 1)) < 64);
+    }
+    return 0;
+}
+
+double _test_ssb(int mod_lsb, int demod_lsb) {
+    struct ssb_modulator mod;
+    struct ssb_demodulator demod;
+    uint32_t phase = 0, fcw = freq_to_fcw(1000, 50000);
+    int16_t audio[500], out[500];
+    uint32_t iq[500];
+    int j, k;
+    double in_power = 0., out_power = 0.;
+    ssb_modulator_init(&mod, mod_lsb);
+    ssb_demodulator_init(&demod, demod_lsb);
+    for (j = 0; j < 10; ++j) {
+        cos16_block(fcw, &phase, audio, 500);
+        ssb_mod_block(&mod, audio, iq, 500);
+        ssb_demod_block(&demod, iq, out, 500);
+        if (j < 2)
+            continue;
+        for (k = 0; k < 500; ++k) {
+            in_power += (double)audio[k] * audio[k];
+            out_power += (double)out[k] * out[k];
+        }
+    }
+    return out_power / in_power;
+}
+
+int test_ssb(void* data) {
+    assert(fabs(_test_ssb(0, 0) - 1.) < 0.05);
+    assert(fabs(_test_ssb(1, 1) - 1.) < 0.05);
+    // Opposite sideband rejected by better than 40dB.
+    assert(_test_ssb(0, 1) < 1e-4);
+    assert(_test_ssb(1, 0) < 1e-4);
+    return 0;
+}
+
+int test_awgn(void* data) {
+    struct noise n;
+    int16_t s[1001];
+    uint32_t iq[1000];
+    int j, k;
+    double sum = 0., power = 0., fourth = 0., cross = 0.;
+    int count = 0;
+    noise_init(&n, 1, 4096);
+    for (j = 0; j < 100; ++j) {
+        awgn_block(&n, s, 1001);
+        for (k = 0; k < 1001; ++k) {
+            double v = s[k] / 4096.;
+            sum += v;
+            power += v * v;
+            fourth += v * v * v * v;
+        }
+        count += 1001;
+    }
+    // Zero mean, unit variance and a Gaussian kurtosis of 3.
+    assert(fabs(sum / count) < 0.02);
+    assert(fabs(power / count - 1.) < 0.02);
+    assert(fabs(fourth / count - 3.) < 0.1);
+
+    power = 0.;
+    for (j = 0; j < 100; ++j) {
+        awgn_iq_block(&n, iq, 1000);
+        for (k = 0; k < 1000; ++k) {
+            int16_t i, q;
+            QUAD_UNPACK(iq[k], i, q);
+            power += (double)i * i + (double)q * q;
+            cross += (double)i * q;
+        }
+    }
+    assert(fabs(power / 200000. / (4096. * 4096.) - 1.) < 0.02);
+    assert(fabs(cross / 100000. / (4096. * 4096.)) < 0.02);
+    return 0;
+}
+
+int test_mixer(void* data) {
+    struct mixer m = { 0, 0 };
+    uint32_t phase = 0, expected_phase = 0;
+    uint32_t fcw = freq_to_fcw(1000, 50000), expected_fcw = freq_to_fcw(3000, 50000);
+    uint32_t iq[300], expected[300];
+    int k;
+    // 1kHz shifted up by 2kHz is 3kHz; then back down again.
+    mixer_set_frequency(&m, 2000, 50000);
+    sincos16c_block(fcw, &phase, iq, 300);
+    mixer_block(&m, iq, iq, 300);
+    sincos16c_block(expected_fcw, &expected_phase, expected, 300);
+    for (k = 0; k < 300; ++k) {
+        int16_t i, q, ei, eq;
+        QUAD_UNPACK(iq[k], i, q);
+        QUAD_UNPACK(expected[k], ei, eq);
+        assert(abs(i - ei) < 256 && abs(q - eq) < 256);
+    }
+    m.phase = 0;
+    mixer_set_frequency(&m, -2000, 50000);
+    phase = 0;
+    sincos16c_block(fcw, &phase, expected, 300);
+    mixer_block(&m, iq, iq, 300);
+    for (k = 0; k < 300; ++k) {
+        int16_t i, q, ei, eq;
+        QUAD_UNPACK(iq[k], i, q);
+        QUAD_UNPACK(expected[k], ei, eq);
+        assert(abs(i - ei) < 512 && abs(q - eq) < 512);
+    }
+    return 0;
+}
+
+void _test_fft(int order, uint32_t *x) {
+    static uint32_t y[1 << FFT_MAX_ORDER];
+    int n = 1 << order;
+    int k, j, e;
+    double peak = 0., worst = 0.;
+    e = fft16_copy(x, y, order);
+    for (k = 0; k < n; ++k) {
+        double re = 0., im = 0., dr, di;
+        int16_t i, q;
+        for (j = 0; j < n; ++j) {
+            double a = -2. * M_PI * j * k / n;
+            QUAD_UNPACK(x[j], i, q);
+            re += i * cos(a) - q * sin(a);
+            im += i * sin(a) + q * cos(a);
+        }
+        QUAD_UNPACK(y[k], i, q);
+        dr = ldexp(i, e) - re;
+        di = ldexp(q, e) - im;
+        if (hypot(re, im) > peak)
+            peak = hypot(re, im);
+        if (hypot(dr, di) > worst)
+            worst = hypot(dr, di);
+    }
+    // Error well under 1% of the largest bin.
+    assert(worst < peak / 200.);
+    assert(fft16(x, order) == e);
+    assert(memcmp(x, y, n * sizeof(uint32_t)) == 0);
+}
+
+int test_fft(void* data) {
+    static uint32_t x[1 << FFT_MAX_ORDER];
+    struct noise noise;
+    int order, k;
+    noise_init(&noise, 7, 2000);
+    for (order = 1; order <= FFT_MAX_ORDER; ++order) {
+        int n = 1 << order;
+        uint32_t phase = 0;
+        // A full scale tone between bins, then the same with noise added,
+        // then an impulse.
+        sincos16c_block(freq_to_fcw(1.3 * 50000 / n, 50000), &phase, x, n);
+        _test_fft(order, x);
+
+        awgn_iq_block(&noise, x, n);
+        _test_fft(order, x);
+
+        for (k = 0; k < n; ++k)
+            x[k] = k == 0 ? QUAD_PACK(32767, -32768) : 0;
+        _test_fft(order, x);
+    }
+    return 0;
+}
+
+int test_spectrum(void* data) {
+    static struct spectrum s;
+    uint32_t iq[100];
+    uint8_t bins[256];
+    uint32_t phase = 0;
+    // A tone 16 bins below centre, at -6dBFS.
+    uint32_t fcw = DDS_PA_MAX - freq_to_fcw(16 * 50000. / 256, 50000);
+    int k, used, frames = 0;
+    assert(spectrum_init(&s, 5) < 0);
+    assert(spectrum_init(&s, 8) == 0);
+    assert(spectrum_read(&s, bins) == 0);
+    while (frames < 3) {
+        sincos16c_block(fcw, &phase, iq, 100);
+        for (k = 0; k < 100; ++k) {
+            int16_t i, q;
+            QUAD_UNPACK(iq[k], i, q);
+            iq[k] = QUAD_PACK(i >> 1, q >> 1);
+        }
+        used = spectrum_push(&s, iq, 100);
+        if (used < 100) {
+            frames++;
+            assert(spectrum_push(&s, iq + used, 100 - used) == 100 - used);
+        }
+    }
+    assert(spectrum_read(&s, bins) == 3);
+    assert(abs(bins[128 - 16] - (255 - 12)) <= 2);
+    for (k = 0; k < 256; ++k) {
+        if (abs(k - (128 - 16)) > 3)
+            assert(bins[k] < bins[128 - 16] - 60);
+    }
+    assert(spectrum_read(&s, bins) == 0);
+    return 0;
+}
+
+int test_iq_energy(void* data) {
+    uint32_t iq[256];
+    uint32_t phase = 0;
+    int k;
+    // A full scale tone is 0dBFS, and half scale 6dB down.
+    sincos16c_block(freq_to_fcw(1000, 50000), &phase, iq, 256);
+    assert(fabs(iq_power_dbfs(iq_energy(iq, 256), 256)) < 0.1);
+    for (k = 0; k < 256; ++k) {
+        int16_t i, q;
+        QUAD_UNPACK(iq[k], i, q);
+        iq[k] = QUAD_PACK(i >> 1, q >> 1);
+    }
+    assert(fabs(iq_power_dbfs(iq_energy(iq, 256), 256) + 6.02) < 0.1);
+    iq[0] = QUAD_PACK(-32768, -32768);
+    assert(iq_energy(iq, 1) == 2ULL * 32768 * 32768);
+    memset(iq, 0, sizeof(iq));
+    assert(iq_power_dbfs(iq_energy(iq, 256), 256) == -HUGE_VAL);
+    return 0;
+}
+
 int test_cic_shift(void* data) {
     assert(whitebox_cic_shift(128) == 20);
     return 0;
@@ -25,6 +419,19 @@ int main(int argc, char **argv) {
     dsp_init();
     whitebox_test_t tests[] = {
         WHITEBOX_TEST(test_sincos16),
+        WHITEBOX_TEST(test_sincos16c_block),
+        WHITEBOX_TEST(test_cos16_block),
+        WHITEBOX_TEST(test_resample),
+        WHITEBOX_TEST(test_resample_stopband),
+        WHITEBOX_TEST(test_atan2_16),
+        WHITEBOX_TEST(test_fm_loopback),
+        WHITEBOX_TEST(test_hilbert),
+        WHITEBOX_TEST(test_ssb),
+        WHITEBOX_TEST(test_awgn),
+        WHITEBOX_TEST(test_mixer),
+        WHITEBOX_TEST(test_fft),
+        WHITEBOX_TEST(test_spectrum),
+        WHITEBOX_TEST(test_iq_energy),
         WHITEBOX_TEST(test_cic_shift),
         WHITEBOX_TEST(0),
     };
@@ -0,0 +1,219 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "whitebox_test.h"
+
+#include "cJSON.h"
+#include "json_stream.h"
+
+#define BENCH_ITERATIONS 20000
+
+static const char set_command[] =
+    "{\"command\":\"set\",\"frequency\":146520000,\"mode\":\"fm\"}";
+
+struct fields {
+    char command[16];
+    double frequency;
+    char mode[16];
+    int count;
+};
+
+static int collect(const struct json_token *name,
+        const struct json_token *value, void *context)
+{
+    struct fields *f = (struct fields *)context;
+    f->count++;
+    if (json_token_equals(name, "command"))
+        return json_token_copy(value, f->command, sizeof(f->command));
+    if (json_token_equals(name, "frequency"))
+        return json_token_double(value, &f->frequency);
+    if (json_token_equals(name, "mode"))
+        return json_token_copy(value, f->mode, sizeof(f->mode));
+    return 0;
+}
+
+static float elapsed_ns(struct timespec start, struct timespec end)
+{
+    return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+int test_json_scan(void* data) {
+    struct fields f;
+    memset(&f, 0, sizeof(f));
+    assert(json_scan_object(set_command, strlen(set_command), collect, &f) == 0);
+    assert(f.count == 3);
+    assert(strcmp(f.command, "set") == 0);
+    assert(f.frequency == 146520000.0);
+    assert(strcmp(f.mode, "fm") == 0);
+    return 0;
+}
+
+int test_json_scan_nested(void* data) {
+    static const char text[] =
+        " { \"a\" : [1, -2.5e3, {\"b\": [true, false, null]}],\n"
+        "   \"command\" : \"re\\\"ce\\u0069ve\" } ";
+    struct fields f;
+    memset(&f, 0, sizeof(f));
+    // Not NUL terminated: the scan must stop at the length.
+    assert(json_scan_object(text, sizeof(text) - 1, collect, &f) == 0);
+    assert(f.count == 2);
+    assert(strcmp(f.command, "re\"ceive") == 0);
+    return 0;
+}
+
+int test_json_scan_malformed(void* data) {
+    static const char *bad[] = {
+        "", "[]", "{", "{\"a\"}", "{\"a\":}", "{\"a\":1,}", "{\"a\":01x}",
+        "{\"a\":tru}", "{\"a\":\"b}", "{\"a\":1} x", "{a:1}", 0
+    };
+    struct fields f;
+    int i;
+    for (i = 0; bad[i]; ++i) {
+        memset(&f, 0, sizeof(f));
+        assert(json_scan_object(bad[i], strlen(bad[i]), collect, &f) != 0);
+    }
+    // A callback's nonzero return stops the scan and is passed back.
+    memset(&f, 0, sizeof(f));
+    assert(json_scan_object("{\"mode\":\"much too long a mode\"}", 31,
+            collect, &f) == -1);
+    return 0;
+}
+
+int test_json_writer(void* data) {
+    static const int fill[3] = { 0, 7, -12 };
+    char buf[256];
+    struct json_writer w;
+    json_writer_init(&w, buf, sizeof(buf));
+    json_object_begin(&w, NULL);
+    json_write_number(&w, "frequency", 146520000.0);
+    json_write_string(&w, "mode", "f\"m\n");
+    json_write_number(&w, "ratio", 0.25);
+    json_write_int_array(&w, "fill", fill, 3);
+    json_array_begin(&w, "clients");
+    json_object_begin(&w, NULL);
+    json_write_long(&w, "queued", -3);
+    json_object_end(&w);
+    json_object_begin(&w, NULL);
+    json_object_end(&w);
+    json_array_end(&w);
+    json_object_end(&w);
+    assert(!json_writer_overflowed(&w));
+    buf[json_writer_length(&w)] = '\0';
+    assert(strcmp(buf, "{\"frequency\":146520000,\"mode\":\"f\\\"m\\n\","
+            "\"ratio\":0.25,\"fill\":[0,7,-12],"
+            "\"clients\":[{\"queued\":-3},{}]}") == 0);
+
+    // What it writes, cJSON reads.
+    {
+        cJSON *json = cJSON_Parse(buf);
+        assert(json);
+        assert(strcmp(cJSON_GetObjectItem(json, "mode")->valuestring,
+                "f\"m\n") == 0);
+        cJSON_Delete(json);
+    }
+
+    // Too small a buffer is reported, not overrun.
+    json_writer_init(&w, buf, 10);
+    json_object_begin(&w, NULL);
+    json_write_string(&w, "mode", "usb");
+    json_object_end(&w);
+    assert(json_writer_overflowed(&w));
+    assert(json_writer_length(&w) <= 10);
+    return 0;
+}
+
+static size_t write_status(char *buf, size_t size)
+{
+    static const int fill[9] = { 0, 1, 2, 40, 900, 30, 2, 0, 0 };
+    struct json_writer w;
+    json_writer_init(&w, buf, size);
+    json_object_begin(&w, NULL);
+    json_write_number(&w, "frequency", 146520000.0);
+    json_write_string(&w, "mode", "fm");
+    json_write_long(&w, "overruns", 3);
+    json_write_long(&w, "underruns", 1);
+    json_write_long(&w, "backlog", 2048);
+    json_write_int_array(&w, "fill", fill, 9);
+    json_write_long(&w, "dropped", 0);
+    json_object_end(&w);
+    return json_writer_length(&w);
+}
+
+static size_t print_status(char *buf, size_t size)
+{
+    static const int fill[9] = { 0, 1, 2, 40, 900, 30, 2, 0, 0 };
+    cJSON *json = cJSON_CreateObject();
+    char *text;
+    size_t length;
+    cJSON_AddNumberToObject(json, "frequency", 146520000.0);
+    cJSON_AddStringToObject(json, "mode", "fm");
+    cJSON_AddNumberToObject(json, "overruns", 3);
+    cJSON_AddNumberToObject(json, "underruns", 1);
+    cJSON_AddNumberToObject(json, "backlog", 2048);
+    cJSON_AddItemToObject(json, "fill", cJSON_CreateIntArray(fill, 9));
+    cJSON_AddNumberToObject(json, "dropped", 0);
+    text = cJSON_PrintUnformatted(json);
+    length = strlen(text);
+    if (length < size)
+        strcpy(buf, text);
+    free(text);
+    cJSON_Delete(json);
+    return length;
+}
+
+// Not a pass/fail test: prints the cost of each path per call, as the
+// server uses them, so the two can be compared on the target.
+int test_json_benchmark(void* data) {
+    struct timespec start, finish;
+    struct fields f;
+    char buf[512], cjson_buf[512];
+    size_t length = 0;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < BENCH_ITERATIONS; ++i) {
+        cJSON *json = cJSON_Parse(set_command);
+        f.frequency = cJSON_GetObjectItem(json, "frequency")->valuedouble;
+        strcpy(f.mode, cJSON_GetObjectItem(json, "mode")->valuestring);
+        cJSON_Delete(json);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    printf("cJSON parse %.0f ns, ", elapsed_ns(start, finish) / BENCH_ITERATIONS);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < BENCH_ITERATIONS; ++i)
+        json_scan_object(set_command, sizeof(set_command) - 1, collect, &f);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    printf("scan %.0f ns\n", elapsed_ns(start, finish) / BENCH_ITERATIONS);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < BENCH_ITERATIONS; ++i)
+        length = print_status(cjson_buf, sizeof(cjson_buf));
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    printf("cJSON status %.0f ns, ", elapsed_ns(start, finish) / BENCH_ITERATIONS);
+    cjson_buf[length] = '\0';
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < BENCH_ITERATIONS; ++i)
+        length = write_status(buf, sizeof(buf));
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    printf("writer %.0f ns\n", elapsed_ns(start, finish) / BENCH_ITERATIONS);
+    buf[length] = '\0';
+
+    // Both paths produce the same document.
+    assert(strcmp(buf, cjson_buf) == 0);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    whitebox_test_t tests[] = {
+        WHITEBOX_TEST(test_json_scan),
+        WHITEBOX_TEST(test_json_scan_nested),
+        WHITEBOX_TEST(test_json_scan_malformed),
+        WHITEBOX_TEST(test_json_writer),
+        WHITEBOX_TEST(test_json_benchmark),
+        WHITEBOX_TEST(0),
+    };
+    return whitebox_test_main(tests, NULL, argc, argv);
+}
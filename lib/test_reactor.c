@@ -45,10 +45,12 @@ int interval_test_reactor(int sampler_interval_ms) {
 
     printf("time is %f\n", diff(start, finish));
     assert(fabsf(duration - diff(start, finish)) < 0.1);
-    printf("count is %d\n", (evbuffer_get_length(sink->buffer)/sizeof(struct timespec)));
-    count = evbuffer_get_length(sink->buffer)/sizeof(struct timespec);
-    evbuffer_remove(sink->buffer, &a, sizeof(struct timespec));
-    while (evbuffer_remove(sink->buffer, &b, sizeof(struct timespec)) > 0) {
+    printf("count is %d\n",
+            (reactor_buffer_get_length(sink->buffer)/sizeof(struct timespec)));
+    count = reactor_buffer_get_length(sink->buffer)/sizeof(struct timespec);
+    reactor_buffer_remove(sink->buffer, &a, sizeof(struct timespec));
+    while (reactor_buffer_remove(sink->buffer, &b,
+                sizeof(struct timespec)) > 0) {
         float d = fabsf((float)(diff(a, b) * 1000) - sampler_interval_ms);
         printf("step is %f ", d);
         if (d > ((float)sampler_interval_ms)/1000*2) {
@@ -0,0 +1,114 @@
+#include <stdint.h>
+#include <pthread.h>
+#include "whitebox_test.h"
+#include "spsc_ring.h"
+
+int test_ring_wrap(void* data) {
+    static spsc_ring<int16_t, 16> ring;
+    int16_t in[10], out[10];
+    int i, j;
+    assert(((uintptr_t)&ring & (SPSC_RING_CACHE_LINE - 1)) == 0);
+    assert(ring.capacity() == 16);
+    assert(ring.fill() == 0);
+    // Ten at a time walks the indices across the end of the storage.
+    for (j = 0; j < 20; ++j) {
+        for (i = 0; i < 10; ++i)
+            in[i] = j * 10 + i;
+        assert(ring.write(in, 10) == 10);
+        assert(ring.fill() == 10);
+        assert(ring.read(out, 10) == 10);
+        for (i = 0; i < 10; ++i)
+            assert(out[i] == j * 10 + i);
+    }
+    assert(ring.overflow_count() == 0);
+    assert(ring.underflow_count() == 0);
+    assert(ring.max_fill() == 10);
+    return 0;
+}
+
+int test_ring_full(void* data) {
+    static spsc_ring<int16_t, 16> ring;
+    int16_t in[20] = { 0 }, out[20];
+    // Every slot is usable.
+    assert(ring.write(in, 20) == 16);
+    assert(ring.fill() == 16);
+    assert(ring.overflow_count() == 4);
+    assert(ring.write_block().length == 0);
+    assert(ring.read(out, 20) == 16);
+    assert(ring.underflow_count() == 4);
+    assert(ring.read_block().length == 0);
+    assert(ring.max_fill() == 16);
+    return 0;
+}
+
+int test_ring_blocks(void* data) {
+    static spsc_ring<uint32_t, 8> ring;
+    spsc_span<uint32_t> w;
+    spsc_span<const uint32_t> r;
+    uint32_t i;
+    // Move the indices to 6, so the next write is split by the end.
+    w = ring.write_block();
+    assert(w.length == 8);
+    ring.write_commit(6);
+    ring.read_commit(6);
+    w = ring.write_block();
+    assert(w.length == 2);
+    for (i = 0; i < w.length; ++i)
+        w.data[i] = i;
+    ring.write_commit(w.length);
+    w = ring.write_block();
+    assert(w.length == 6);
+    for (i = 0; i < 3; ++i)
+        w.data[i] = i + 2;
+    ring.write_commit(3);
+    r = ring.read_block();
+    assert(r.length == 2 && r.data[0] == 0 && r.data[1] == 1);
+    ring.read_commit(r.length);
+    r = ring.read_block();
+    assert(r.length == 3 && r.data[0] == 2 && r.data[2] == 4);
+    ring.read_commit(r.length);
+    assert(ring.fill() == 0);
+    return 0;
+}
+
+#define STRESS_COUNT 1000000
+
+static spsc_ring<uint32_t, 256> stress_ring;
+
+static void *stress_producer(void *data) {
+    uint32_t next = 0;
+    while (next < STRESS_COUNT) {
+        spsc_span<uint32_t> w = stress_ring.write_block();
+        uint32_t i;
+        for (i = 0; i < w.length && next < STRESS_COUNT; ++i)
+            w.data[i] = next++;
+        stress_ring.write_commit(i);
+    }
+    return 0;
+}
+
+int test_ring_threads(void* data) {
+    pthread_t producer;
+    uint32_t expected = 0;
+    assert(pthread_create(&producer, 0, stress_producer, 0) == 0);
+    while (expected < STRESS_COUNT) {
+        spsc_span<const uint32_t> r = stress_ring.read_block();
+        for (size_t i = 0; i < r.length; ++i)
+            assert(r.data[i] == expected++);
+        stress_ring.read_commit(r.length);
+    }
+    pthread_join(producer, 0);
+    assert(stress_ring.max_fill() <= 256);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    whitebox_test_t tests[] = {
+        WHITEBOX_TEST(test_ring_wrap),
+        WHITEBOX_TEST(test_ring_full),
+        WHITEBOX_TEST(test_ring_blocks),
+        WHITEBOX_TEST(test_ring_threads),
+        WHITEBOX_TEST(0),
+    };
+    return whitebox_test_main(tests, NULL, argc, argv);
+}
@@ -3,7 +3,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/mman.h>
+#include <sys/time.h>
 #include <math.h>
 
 #include "whitebox.h"
@@ -65,10 +67,73 @@ int whitebox_parameter_get(const char *param)
     return atoi(final_value);
 }
 
+// Their names under /sys/module/whitebox/parameters, by WP_* id.
+static const char *whitebox_param_names[WP_COUNT] = {
+    [WP_USER_ORDER] = "user_order",
+    [WP_USER_SOURCE_BUFFER_THRESHOLD] = "user_source_buffer_threshold",
+    [WP_USER_SINK_BUFFER_THRESHOLD] = "user_sink_buffer_threshold",
+    [WP_FLOW_CONTROL] = "flow_control",
+    [WP_FRAME_SIZE] = "frame_size",
+};
+
+// Older drivers answer EINVAL to an ioctl they don't know, which is only
+// told apart from a real error by the probe at open.  Anything else the
+// ioctl fails with is passed back rather than retried through sysfs, which
+// would skip the driver's range checks.
+static int whitebox_param_probe(whitebox_t* wb)
+{
+    whitebox_param_t p;
+    p.id = WP_USER_ORDER;
+    if (ioctl(wb->fd, W_PARAM_GET, &p) == 0)
+        return 1;
+    return errno != ENOTTY && errno != EINVAL;
+}
+
+int whitebox_param_set(whitebox_t* wb, int id, int value)
+{
+    whitebox_param_t p;
+    if (id < 0 || id >= WP_COUNT) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!wb->param_ioctl)
+        return whitebox_parameter_set(whitebox_param_names[id], value);
+    p.id = id;
+    p.value = value;
+    if (ioctl(wb->fd, W_PARAM_SET, &p) == 0)
+        return 0;
+    if (errno != ENOTTY)
+        return -1;
+    return whitebox_parameter_set(whitebox_param_names[id], value);
+}
+
+int whitebox_param_get(whitebox_t* wb, int id)
+{
+    whitebox_param_t p;
+    if (id < 0 || id >= WP_COUNT) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!wb->param_ioctl)
+        return whitebox_parameter_get(whitebox_param_names[id]);
+    p.id = id;
+    if (ioctl(wb->fd, W_PARAM_GET, &p) == 0)
+        return p.value;
+    if (errno != ENOTTY)
+        return -1;
+    return whitebox_parameter_get(whitebox_param_names[id]);
+}
 
 void whitebox_init(whitebox_t* wb) {
     wb->fd = -EINVAL;
     adf4351_init(&wb->adf4351);
+    memset(&wb->shadow, 0, sizeof(wb->shadow));
+    wb->fir_loaded = 0;
+    wb->transaction = 0;
+    wb->synth_count = 0;
+    wb->synth_next = 0;
+    memset(wb->adf4351_regs, 0, sizeof(wb->adf4351_regs));
+    wb->param_ioctl = 0;
 }
 
 whitebox_t* whitebox_alloc(void) {
@@ -107,6 +172,7 @@ int whitebox_open(whitebox_t* wb, const char* filn, int flags, int rate) {
     if (wb->fd < 0) {
         return -1;
     }
+    wb->param_ioctl = whitebox_param_probe(wb);
 
     if (W_DAC_RATE_HZ % rate != 0) {
         return -1;
@@ -117,8 +183,10 @@ int whitebox_open(whitebox_t* wb, const char* filn, int flags, int rate) {
 
     whitebox_reset(wb);
 
+    whitebox_begin(wb);
     whitebox_tx_set_interp(wb, wb->interp);
     whitebox_rx_set_decim(wb, wb->interp);
+    whitebox_commit(wb);
     //whitebox_tx_set_buffer_threshold(wb, rate/10, WE_FIFO_SIZE - rate/10);
 
     free(filename);
@@ -127,7 +195,7 @@ int whitebox_open(whitebox_t* wb, const char* filn, int flags, int rate) {
 }
 
 int whitebox_mmap(whitebox_t* wb) {
-    wb->user_buffer_size = sysconf(_SC_PAGE_SIZE) << whitebox_parameter_get("user_order");
+    wb->user_buffer_size = sysconf(_SC_PAGE_SIZE) << whitebox_param_get(wb, WP_USER_ORDER);
     wb->user_buffer = mmap(0, wb->user_buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED, wb->fd, 0);
     if (wb->user_buffer == MAP_FAILED || !wb->user_buffer)
         return -1;
@@ -138,6 +206,17 @@ int whitebox_munmap(whitebox_t *wb) {
     return munmap(wb->user_buffer, wb->user_buffer_size);
 }
 
+// While mapped, the driver ignores the buffer write() and read() are given
+// and takes the count as a commit.  The mapping is passed rather than NULL,
+// which the libc declares nonnull.
+ssize_t whitebox_tx_commit(whitebox_t* wb, size_t bytes) {
+    return write(wb->fd, wb->user_buffer, bytes);
+}
+
+ssize_t whitebox_rx_commit(whitebox_t* wb, size_t bytes) {
+    return read(wb->fd, wb->user_buffer, bytes);
+}
+
 int whitebox_fd(whitebox_t* wb) {
     return wb->fd;
 }
@@ -203,23 +282,210 @@ void whitebox_debug_to_file(whitebox_t* wb, FILE* f) {
 }
 
 
+// Reads back what the shadow covers.  The driver sets the thresholds,
+// correction and gain from its module parameters at open.
+static int whitebox_shadow_load(whitebox_t* wb) {
+    whitebox_args_t w;
+    memset(&wb->shadow, 0, sizeof(wb->shadow));
+    wb->fir_loaded = 0;
+
+    if (ioctl(wb->fd, WE_GET, &w) < 0)
+        return -1;
+    wb->shadow.exciter.interp = w.flags.exciter.interp;
+    wb->shadow.exciter.fcw = w.flags.exciter.fcw;
+    wb->shadow.exciter.threshold = w.flags.exciter.threshold;
+    wb->shadow.exciter.correction = w.flags.exciter.correction;
+    wb->shadow.exciter.gain = w.flags.exciter.gain;
+
+    if (ioctl(wb->fd, WR_GET, &w) < 0)
+        return -1;
+    wb->shadow.receiver.decim = w.flags.receiver.decim;
+    wb->shadow.receiver.fcw = w.flags.receiver.fcw;
+    wb->shadow.receiver.threshold = w.flags.receiver.threshold;
+    wb->shadow.receiver.correction = w.flags.receiver.correction;
+
+    if (ioctl(wb->fd, WA_GET, &w) < 0)
+        return -1;
+    memcpy(wb->adf4351_regs, w.flags.adf4351, sizeof(wb->adf4351_regs));
+    return 0;
+}
+
 int whitebox_reset(whitebox_t* wb) {
+    int err;
     if (wb->fd < 0) {
         return -EBADF;
     }
-    return ioctl(wb->fd, W_RESET);
+    if ((err = ioctl(wb->fd, W_RESET)) < 0)
+        return err;
+    return whitebox_shadow_load(wb);
+}
+
+// Writes the dirty fields unless a transaction is open.
+static int whitebox_flush(whitebox_t* wb) {
+    if (wb->transaction > 0 || !wb->shadow.dirty)
+        return 0;
+    if (ioctl(wb->fd, W_COMMIT, &wb->shadow) < 0) {
+        // Whatever did get written, the shadow must match the hardware.
+        whitebox_shadow_load(wb);
+        return -1;
+    }
+    wb->shadow.dirty = 0;
+    wb->shadow.exciter.state = 0;
+    wb->shadow.receiver.state = 0;
+    return 0;
+}
+
+static int whitebox_shadow_set(whitebox_t* wb, uint32_t *field,
+        uint32_t value, uint32_t dirty) {
+    if (*field != value) {
+        *field = value;
+        wb->shadow.dirty |= dirty;
+    }
+    return whitebox_flush(wb);
+}
+
+void whitebox_begin(whitebox_t* wb) {
+    wb->transaction++;
+}
+
+int whitebox_commit(whitebox_t* wb) {
+    if (wb->transaction > 0)
+        wb->transaction--;
+    return whitebox_flush(wb);
+}
+
+static unsigned whitebox_elapsed_us(const struct timeval* start) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000000
+        + (now.tv_usec - start->tv_usec);
+}
+
+int whitebox_plls_wait_locked(whitebox_t* wb, unsigned timeout_us,
+        unsigned* lock_us) {
+    whitebox_lock_wait_t l;
+    struct timeval start;
+    int locked;
+
+    l.timeout_us = timeout_us;
+    l.elapsed_us = 0;
+    if ((locked = ioctl(wb->fd, W_WAIT_LOCKED, &l)) >= 0 || errno == ETIMEDOUT) {
+        if (lock_us)
+            *lock_us = l.elapsed_us;
+        return locked > 0;
+    }
+    if (errno != ENOTTY && errno != EINVAL)
+        return -1;
+
+    // An older driver: ask until it locks or the time is up.
+    gettimeofday(&start, NULL);
+    while (!(locked = ioctl(wb->fd, W_LOCKED) > 0)
+            && whitebox_elapsed_us(&start) < timeout_us)
+        ;
+    if (lock_us)
+        *lock_us = whitebox_elapsed_us(&start);
+    return locked;
 }
 
 int whitebox_plls_locked(whitebox_t* wb) {
-    int i;
     // We wait for a little bit incase tuning just changed
-    for (i = 0; i < 1000; ++i) {
-        if (ioctl(wb->fd, W_LOCKED))
-            return 1;
+    return whitebox_plls_wait_locked(wb, WHITEBOX_LOCK_TIMEOUT_US, NULL) == 1;
+}
+
+static uint32_t whitebox_channel(float frequency) {
+    return (uint32_t)(frequency + 0.5);
+}
+
+static whitebox_synth_t* whitebox_synth_find(whitebox_t* wb, uint32_t channel) {
+    int i;
+    for (i = 0; i < wb->synth_count; ++i) {
+        if (wb->synth[i].channel == channel)
+            return &wb->synth[i];
+    }
+    return NULL;
+}
+
+// Always from the power on defaults, so a channel's registers don't depend
+// on what was tuned before it.
+static void whitebox_synth_compute(whitebox_synth_t* s, uint32_t channel) {
+    adf4351_t adf4351;
+    whitebox_args_t w;
+    float vco_frequency = (channel + 45.00e6) * 4.0;
+
+    adf4351_init(&adf4351);
+    adf4351_pll_enable(&adf4351, WA_CLOCK_RATE, 8e3, vco_frequency);
+    adf4351_ioctl_set(&adf4351, &w);
+    s->channel = channel;
+    memcpy(s->adf4351, w.flags.adf4351, sizeof(s->adf4351));
+}
+
+// Finds the entry for a channel, working it out on a miss.  Returns NULL
+// only when every entry is pinned by the plan.
+static whitebox_synth_t* whitebox_synth_get(whitebox_t* wb, uint32_t channel,
+        int pinned) {
+    whitebox_synth_t* s;
+    int i;
+
+    if ((s = whitebox_synth_find(wb, channel))) {
+        s->pinned |= pinned;
+        return s;
+    }
+    if (wb->synth_count < WHITEBOX_SYNTH_CACHE_SIZE) {
+        s = &wb->synth[wb->synth_count++];
+    } else {
+        for (i = 0; i < WHITEBOX_SYNTH_CACHE_SIZE; ++i) {
+            s = &wb->synth[wb->synth_next];
+            wb->synth_next = (wb->synth_next + 1) % WHITEBOX_SYNTH_CACHE_SIZE;
+            if (!s->pinned)
+                break;
+        }
+        if (s->pinned)
+            return NULL;
+    }
+    whitebox_synth_compute(s, channel);
+    s->pinned = pinned;
+    return s;
+}
+
+int whitebox_channel_plan(whitebox_t* wb, const float* frequencies, int count) {
+    int i;
+    for (i = 0; i < count; ++i) {
+        if ((frequencies[i] + 45.00e6) * 4.0 <= 35.00e6)
+            return -EINVAL;
+        if (!whitebox_synth_get(wb, whitebox_channel(frequencies[i]), 1))
+            return -ENOSPC;
     }
     return 0;
 }
 
+void whitebox_channel_plan_clear(whitebox_t* wb) {
+    wb->synth_count = 0;
+    wb->synth_next = 0;
+}
+
+// Tunes the ADF4351 from the cache.  Nothing is sent when the registers
+// are already loaded, and the driver writes only the ones that changed.
+static int whitebox_synth_tune(whitebox_t* wb, float frequency) {
+    whitebox_synth_t* s;
+    whitebox_synth_t scratch;
+    whitebox_args_t w;
+    int err;
+
+    if ((s = whitebox_synth_get(wb, whitebox_channel(frequency), 0)) == NULL) {
+        whitebox_synth_compute(&scratch, whitebox_channel(frequency));
+        s = &scratch;
+    }
+    if (memcmp(s->adf4351, wb->adf4351_regs, sizeof(wb->adf4351_regs)) == 0)
+        return 0;
+
+    memcpy(w.flags.adf4351, s->adf4351, sizeof(s->adf4351));
+    if ((err = ioctl(wb->fd, WA_SET, &w)) < 0)
+        return err;
+    memcpy(wb->adf4351_regs, s->adf4351, sizeof(wb->adf4351_regs));
+    adf4351_ioctl_get(&wb->adf4351, &w);
+    return 0;
+}
+
 int whitebox_tx_clear(whitebox_t* wb) {
     if (wb->fd < 0) {
         return -EBADF;
@@ -239,15 +505,8 @@ int whitebox_tx(whitebox_t* wb, float frequency) {
     }
     //printf("%f %f\n", frequency, vco_frequency);
 
-    if ((err = ioctl(wb->fd, WA_GET, &w)) < 0)
+    if ((err = whitebox_synth_tune(wb, frequency)) < 0)
         return err;
-    adf4351_ioctl_get(&wb->adf4351, &w);
-
-    adf4351_pll_enable(&wb->adf4351, WA_CLOCK_RATE, 8e3, vco_frequency);
-    adf4351_ioctl_set(&wb->adf4351, &w);
-    if ((err = ioctl(wb->fd, WA_SET, &w)) < 0)
-        return err;
-
 
     if ((err = ioctl(wb->fd, WC_GET, &w)) < 0)
         return err;
@@ -310,12 +569,7 @@ int whitebox_tx_fine_tune(whitebox_t *wb, float frequency) {
         return 2;
     }
 
-    adf4351_pll_enable(&wb->adf4351, WA_CLOCK_RATE, 8e3, vco_frequency);
-    adf4351_ioctl_set(&wb->adf4351, &w);
-    if ((err = ioctl(wb->fd, WA_SET, &w)) < 0)
-        return err;
-
-    return 0;
+    return whitebox_synth_tune(wb, frequency);
 }
 
 uint16_t whitebox_cic_shift(uint16_t interp)
@@ -331,29 +585,25 @@ uint16_t whitebox_cic_shift(uint16_t interp)
 
 int whitebox_tx_set_interp(whitebox_t* wb, uint32_t interp) {
     uint16_t shift;
-    whitebox_args_t w;
-    ioctl(wb->fd, WE_GET, &w);
     shift = whitebox_cic_shift(interp);
-    w.flags.exciter.interp = ((((uint32_t)shift) << 16) & 0xffff0000) | (interp & 0xffff);
-    ioctl(wb->fd, WE_SET, &w);
+    return whitebox_shadow_set(wb, &wb->shadow.exciter.interp,
+            ((((uint32_t)shift) << 16) & 0xffff0000) | (interp & 0xffff),
+            WCD_EXCITER_INTERP);
 }
 
 int whitebox_tx_set_buffer_threshold(whitebox_t* wb,
             uint16_t aeval, uint16_t afval) {
-    whitebox_args_t w;
-    ioctl(wb->fd, WE_GET, &w);
-    w.flags.exciter.threshold = (uint32_t)aeval |
-                    (uint32_t)(afval << WET_AFVAL_OFFSET);
-    ioctl(wb->fd, WE_SET, &w);
+    return whitebox_shadow_set(wb, &wb->shadow.exciter.threshold,
+            (uint32_t)aeval | (uint32_t)(afval << WET_AFVAL_OFFSET),
+            WCD_EXCITER_THRESHOLD);
 }
 
 void whitebox_tx_get_buffer_threshold(whitebox_t *wb,
             uint16_t *aeval, uint16_t *afval)
 {
-    whitebox_args_t w;            
-    ioctl(wb->fd, WE_GET, &w);
-    *aeval = (uint16_t)(w.flags.exciter.threshold & WET_AEVAL_MASK);
-    *afval = (uint16_t)((w.flags.exciter.threshold & WET_AFVAL_MASK) >> WET_AFVAL_OFFSET);
+    uint32_t threshold = wb->shadow.exciter.threshold;
+    *aeval = (uint16_t)(threshold & WET_AEVAL_MASK);
+    *afval = (uint16_t)((threshold & WET_AFVAL_MASK) >> WET_AFVAL_OFFSET);
 }
 
 int whitebox_tx_get_buffer_runs(whitebox_t* wb,
@@ -368,38 +618,36 @@ int whitebox_tx_get_buffer_runs(whitebox_t* wb,
 int whitebox_tx_set_latency(whitebox_t *wb, int ms)
 {
     int threshold = 4 * wb->rate * ((float)ms * 1e-3);
-    return whitebox_parameter_set("user_source_buffer_threshold", threshold);
+    return whitebox_param_set(wb, WP_USER_SOURCE_BUFFER_THRESHOLD, threshold);
 }
 
 int whitebox_tx_get_latency(whitebox_t *wb)
 {
-    int threshold = whitebox_parameter_get("user_source_buffer_threshold");
+    int threshold = whitebox_param_get(wb, WP_USER_SOURCE_BUFFER_THRESHOLD);
     if (threshold <= 0)
         return threshold;
     int latency_ms = (int)(threshold / (wb->rate * 4 * 1e-3));
     return latency_ms;
 }
 
+long whitebox_tx_fill(whitebox_t *wb)
+{
+    return ioctl(wb->fd, W_TX_FILL);
+}
+
 void whitebox_tx_set_dds_fcw(whitebox_t* wb, uint32_t fcw) {
-    whitebox_args_t w;
-    ioctl(wb->fd, WE_GET, &w);
-    w.flags.exciter.fcw = fcw;
-    ioctl(wb->fd, WE_SET, &w);
+    whitebox_shadow_set(wb, &wb->shadow.exciter.fcw, fcw, WCD_EXCITER_FCW);
 }
 
 int whitebox_tx_flags_enable(whitebox_t* wb, uint32_t flags) {
-    int err;
-    whitebox_args_t w;
-    if ((err = ioctl(wb->fd, WE_GET, &w)) < 0)
-        return err;
-    w.flags.exciter.state |= flags;
-    if ((err = ioctl(wb->fd, WE_SET, &w)) < 0)
-        return err;
-    return 0;
+    wb->shadow.exciter.state |= flags;
+    wb->shadow.dirty |= WCD_EXCITER_STATE;
+    return whitebox_flush(wb);
 }
 
 void whitebox_tx_flags_disable(whitebox_t* wb, uint32_t flags) {
     whitebox_args_t w;
+    wb->shadow.exciter.state &= ~flags;
     w.flags.exciter.state = flags;
     ioctl(wb->fd, WE_CLEAR_MASK, &w);
 }
@@ -412,26 +660,23 @@ void whitebox_tx_dds_enable(whitebox_t* wb, float fdes) {
 
 void whitebox_tx_set_correction(whitebox_t *wb, int16_t correct_i, int16_t correct_q)
 {
-    whitebox_args_t w;
-    ioctl(wb->fd, WE_GET, &w);
-    w.flags.exciter.correction = (uint32_t)(((int32_t)correct_i & WEC_I_MASK) |
-                        (((int32_t)correct_q << WEC_Q_OFFSET) & WEC_Q_MASK));
-    ioctl(wb->fd, WE_SET, &w);
+    whitebox_shadow_set(wb, &wb->shadow.exciter.correction,
+            (uint32_t)(((int32_t)correct_i & WEC_I_MASK) |
+                (((int32_t)correct_q << WEC_Q_OFFSET) & WEC_Q_MASK)),
+            WCD_EXCITER_CORRECTION);
 }
 
 void whitebox_tx_get_correction(whitebox_t *wb, int16_t *correct_i, int16_t *correct_q)
 {
-    whitebox_args_t w;
-    ioctl(wb->fd, WE_GET, &w);
-    *correct_i = ((int16_t)(w.flags.exciter.correction & WEC_I_MASK)) << 6;
+    uint32_t correction = wb->shadow.exciter.correction;
+    *correct_i = ((int16_t)(correction & WEC_I_MASK)) << 6;
     *correct_i >>= 6;
-    *correct_q = (int16_t)(((w.flags.exciter.correction & WEC_Q_MASK)) >> WEC_Q_OFFSET) << 6;
+    *correct_q = (int16_t)(((correction & WEC_Q_MASK)) >> WEC_Q_OFFSET) << 6;
     *correct_q >>= 6;
 }
 
 int whitebox_tx_set_gain(whitebox_t *wb, float gain_i, float gain_q)
 {
-    whitebox_args_t w;
     uint32_t gi, gq, newg;
 
     /*if (!(gain_i >= 0.0 && gain_i < 2.0))
@@ -444,19 +689,16 @@ int whitebox_tx_set_gain(whitebox_t *wb, float gain_i, float gain_q)
     newg = (uint32_t)((gi & WEG_I_MASK) |
             ((gq << WEG_Q_OFFSET) & WEG_Q_MASK));
 
-    ioctl(wb->fd, WE_GET, &w);
-    w.flags.exciter.gain = newg;
-    return ioctl(wb->fd, WE_SET, &w);
+    return whitebox_shadow_set(wb, &wb->shadow.exciter.gain, newg,
+            WCD_EXCITER_GAIN);
 }
 
 int whitebox_tx_get_gain(whitebox_t *wb, float *gain_i, float *gain_q)
 {
-    whitebox_args_t w;
     uint32_t gi, gq;
-    ioctl(wb->fd, WE_GET, &w);
-    gi = ((uint32_t)(w.flags.exciter.gain & WEG_I_MASK));
+    gi = ((uint32_t)(wb->shadow.exciter.gain & WEG_I_MASK));
     *gain_i = gi / WEG_COEFF;
-    gq = (uint32_t)(((w.flags.exciter.gain & WEC_Q_MASK)) >> WEC_Q_OFFSET);
+    gq = (uint32_t)(((wb->shadow.exciter.gain & WEC_Q_MASK)) >> WEC_Q_OFFSET);
     *gain_q = gq / WEG_COEFF;
     return 0;
 }
@@ -493,26 +735,18 @@ int whitebox_rx(whitebox_t* wb, float frequency) {
     cmx991_ioctl_set(&wb->cmx991, &w);
     ioctl(wb->fd, WC_SET, &w);
 
-    adf4351_init(&wb->adf4351);
-
-    adf4351_pll_enable(&wb->adf4351, WA_CLOCK_RATE, 8e3, vco_frequency);
-    adf4351_ioctl_set(&wb->adf4351, &w);
-    ioctl(wb->fd, WA_SET, &w);
-    return 0;
+    return whitebox_synth_tune(wb, frequency);
 }
 
 int whitebox_rx_fine_tune(whitebox_t *wb, float frequency) {
     float vco_frequency;
-    whitebox_args_t w;
 
     vco_frequency = (frequency + 45.00e6) * 4.0;
     if (vco_frequency <= 35.00e6) {
         return -1;
     }
 
-    adf4351_pll_enable(&wb->adf4351, WA_CLOCK_RATE, 8e3, vco_frequency);
-    adf4351_ioctl_set(&wb->adf4351, &w);
-    ioctl(wb->fd, WA_SET, &w);
+    return whitebox_synth_tune(wb, frequency);
 }
 
 int whitebox_rx_standby(whitebox_t *wb)
@@ -553,25 +787,128 @@ int whitebox_rx_cal_disable(whitebox_t *wb)
     return 0;
 }
 
-int whitebox_rx_set_decim(whitebox_t* wb, uint32_t decim) {
-    whitebox_args_t w;
-    if (ioctl(wb->fd, WR_GET, &w) < 0)
+// Takes the next n samples the receiver produces, starting it if it's
+// stopped, and adds their energy to *energy unless that's NULL.
+static int whitebox_scan_take(whitebox_t* wb, unsigned long n,
+        uint64_t* energy) {
+    struct pollfd pfd;
+    unsigned long done = 0, src;
+    long count;
+
+    pfd.fd = wb->fd;
+    pfd.events = POLLIN;
+    while (done < n) {
+        if ((count = ioctl(wb->fd, W_MMAP_READ, &src)) < 0)
+            return -1;
+        count >>= 2;
+        if (count == 0) {
+            pfd.revents = 0;
+            if (poll(&pfd, 1, WHITEBOX_SCAN_TIMEOUT_MS) == 0) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            continue;
+        }
+        if (count > n - done)
+            count = n - done;
+        if (energy)
+            *energy += iq_energy((const uint32_t*)src, count);
+        if (whitebox_rx_commit(wb, count << 2) != count << 2)
+            return -1;
+        done += count;
+    }
+    return 0;
+}
+
+// Integrates the power of dwell samples on the channel just tuned.
+static int whitebox_scan_dwell(whitebox_t* wb, unsigned long dwell,
+        float* rssi) {
+    unsigned long src;
+    uint64_t energy = 0;
+    long count;
+    int i;
+
+    // Stopping the receiver doesn't empty the buffer, so whatever is
+    // mapped still belongs to the last channel, or to whoever was
+    // receiving before the scan.  Drop it, both sides of the wrap, and
+    // then the filters' settling.
+    for (i = 0; i < 2; ++i) {
+        if ((count = ioctl(wb->fd, W_MMAP_READ, &src)) < 0)
+            return -1;
+        if (count > 0 && whitebox_rx_commit(wb, count) != count)
+            return -1;
+    }
+    if (whitebox_scan_take(wb, (unsigned long)wb->rate
+            * WHITEBOX_SCAN_SETTLE_US / 1000000, NULL) < 0)
         return -1;
-    w.flags.receiver.decim = decim;
-    if (ioctl(wb->fd, WR_SET, &w) < 0)
+
+    if (whitebox_scan_take(wb, dwell, &energy) < 0)
         return -1;
+    *rssi = iq_power_dbfs(energy, dwell);
     return 0;
 }
 
+float whitebox_scan(whitebox_t* wb, whitebox_scan_channel_t* channels,
+        int count, unsigned long dwell) {
+    struct timeval start;
+    unsigned elapsed;
+    int i, err, room;
+
+    if (count <= 0 || dwell == 0 || !wb->user_buffer)
+        return -1;
+
+    for (i = 0; i < count; ++i) {
+        if ((channels[i].frequency + 45.00e6) * 4.0 <= 35.00e6)
+            return -1;
+    }
+
+    // Work out as many register sets before the first step as the cache
+    // has room for beside the plan; the rest are worked out as the scan
+    // gets to them.  None are pinned, so the plan is left as it was.
+    room = WHITEBOX_SYNTH_CACHE_SIZE;
+    for (i = 0; i < wb->synth_count; ++i)
+        room -= wb->synth[i].pinned;
+    for (i = 0; i < count && i < room; ++i)
+        whitebox_synth_get(wb, whitebox_channel(channels[i].frequency), 0);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < count; ++i) {
+        whitebox_scan_channel_t* c = &channels[i];
+        // Stop the receiver, or it reports the lock lost while we retune.
+        fsync(wb->fd);
+        err = i == 0 ? whitebox_rx(wb, c->frequency)
+            : whitebox_rx_fine_tune(wb, c->frequency);
+        if (err < 0)
+            return -1;
+
+        c->locked = whitebox_plls_wait_locked(wb, WHITEBOX_LOCK_TIMEOUT_US,
+                &c->lock_us);
+        if (c->locked < 0)
+            return -1;
+        c->rssi = -HUGE_VAL;
+        if (c->locked && whitebox_scan_dwell(wb, dwell, &c->rssi) < 0)
+            return -1;
+    }
+    fsync(wb->fd);
+
+    elapsed = whitebox_elapsed_us(&start);
+    return elapsed ? count * 1e6f / elapsed : 0;
+}
+
+int whitebox_rx_set_decim(whitebox_t* wb, uint32_t decim) {
+    return whitebox_shadow_set(wb, &wb->shadow.receiver.decim, decim,
+            WCD_RECEIVER_DECIM);
+}
+
 int whitebox_rx_set_latency(whitebox_t *wb, int ms)
 {
     int threshold = 4 * wb->rate * ((float)ms * 1e-3);
-    return whitebox_parameter_set("user_sink_buffer_threshold", threshold);
+    return whitebox_param_set(wb, WP_USER_SINK_BUFFER_THRESHOLD, threshold);
 }
 
 int whitebox_rx_get_latency(whitebox_t *wb)
 {
-    int threshold = whitebox_parameter_get("user_sink_buffer_threshold");
+    int threshold = whitebox_param_get(wb, WP_USER_SINK_BUFFER_THRESHOLD);
     if (threshold <= 0)
         return threshold;
     int latency_ms = (int)(threshold / (wb->rate * 4 * 1e-3));
@@ -579,60 +916,74 @@ int whitebox_rx_get_latency(whitebox_t *wb)
 }
 
 void whitebox_rx_flags_enable(whitebox_t* wb, uint32_t flags) {
-    whitebox_args_t w;
-    ioctl(wb->fd, WR_GET, &w);
-    w.flags.receiver.state |= flags;
-    ioctl(wb->fd, WR_SET, &w);
+    wb->shadow.receiver.state |= flags;
+    wb->shadow.dirty |= WCD_RECEIVER_STATE;
+    whitebox_flush(wb);
 }
 
 void whitebox_rx_flags_disable(whitebox_t* wb, uint32_t flags) {
     whitebox_args_t w;
+    wb->shadow.receiver.state &= ~flags;
     w.flags.receiver.state = flags;
     ioctl(wb->fd, WR_CLEAR_MASK, &w);
 }
 
 void whitebox_rx_set_correction(whitebox_t *wb, int16_t correct_i, int16_t correct_q)
 {
-    whitebox_args_t w;
-    ioctl(wb->fd, WR_GET, &w);
-    w.flags.receiver.correction = (uint32_t)(((int32_t)correct_i & WEC_I_MASK) |
-                        (((int32_t)correct_q << WEC_Q_OFFSET) & WEC_Q_MASK));
-    ioctl(wb->fd, WR_SET, &w);
+    whitebox_shadow_set(wb, &wb->shadow.receiver.correction,
+            (uint32_t)(((int32_t)correct_i & WEC_I_MASK) |
+                (((int32_t)correct_q << WEC_Q_OFFSET) & WEC_Q_MASK)),
+            WCD_RECEIVER_CORRECTION);
 }
 
 void whitebox_rx_get_correction(whitebox_t *wb, int16_t *correct_i, int16_t *correct_q)
 {
-    whitebox_args_t w;
-    ioctl(wb->fd, WR_GET, &w);
-    *correct_i = ((int16_t)(w.flags.receiver.correction & WEC_I_MASK)) << 6;
+    uint32_t correction = wb->shadow.receiver.correction;
+    *correct_i = ((int16_t)(correction & WEC_I_MASK)) << 6;
     *correct_i >>= 6;
-    *correct_q = (int16_t)(((w.flags.receiver.correction & WEC_Q_MASK)) >> WEC_Q_OFFSET) << 6;
+    *correct_q = (int16_t)(((correction & WEC_Q_MASK)) >> WEC_Q_OFFSET) << 6;
     *correct_q >>= 6;
 }
 
-int whitebox_fir_load_coeffs(whitebox_t *wb, int8_t bank, int8_t N, int32_t *coeffs)
+int whitebox_fir_load_coeffs(whitebox_t *wb, int8_t bank, int N, int32_t *coeffs)
 {
-    int i;
-    whitebox_args_t w;
-    w.flags.fir.bank = bank;
-    w.flags.fir.n = N;
-    for (i = 0; i < N; ++i)
-        w.flags.fir.coeff[i] = coeffs[i];
-
-    ioctl(wb->fd, WF_SET, &w);
-    return 0;
+    // The exciter's FIR register holds the count in seven bits and the
+    // bank in two, so that is all that fits, whatever the array allows.
+    if (N < 0 || N > WHITEBOX_FIR_MAX_COEFFS || bank < 0 || bank > 3)
+        return -EINVAL;
+    wb->shadow.fir.bank = bank;
+    wb->shadow.fir.n = N;
+    memcpy(wb->shadow.fir.coeff, coeffs, N * sizeof(*coeffs));
+    wb->shadow.dirty |= WCD_FIR;
+    wb->fir_loaded = 1;
+    return whitebox_flush(wb);
 }
 
-int whitebox_fir_get_coeffs(whitebox_t *wb, int8_t bank, int8_t N, int32_t *coeffs)
+int whitebox_fir_get_coeffs(whitebox_t *wb, int8_t bank, int N, int32_t *coeffs)
 {
     int i;
     int n;
     whitebox_args_t w;
-    ioctl(wb->fd, WF_GET, &w);
-    n = w.flags.fir.n < N ? w.flags.fir.n : N;
+
+    // Reading the coefficients back is slow, so it is done once at most.
+    if (!wb->fir_loaded) {
+        if (ioctl(wb->fd, WF_GET, &w) < 0)
+            return -1;
+        wb->shadow.fir.bank = w.flags.fir.bank;
+        wb->shadow.fir.n = w.flags.fir.n;
+        memcpy(wb->shadow.fir.coeff, w.flags.fir.coeff,
+                w.flags.fir.n * sizeof(*w.flags.fir.coeff));
+        wb->fir_loaded = 1;
+    }
+    // Only the bank in use can be read back, and that is the one cached.
+    if (wb->shadow.fir.bank != bank) {
+        errno = EINVAL;
+        return -1;
+    }
+    n = wb->shadow.fir.n < N ? wb->shadow.fir.n : N;
     
     for (i = 0; i < n; ++i)
-        coeffs[i] = w.flags.fir.coeff[i];
+        coeffs[i] = wb->shadow.fir.coeff[i];
 
-    return w.flags.fir.n;
+    return wb->shadow.fir.n;
 }
@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <fcntl.h>
+#include <sys/types.h>
 
 #include "whitebox_ioctl.h"
 
@@ -15,6 +16,19 @@
 extern "C" {
 #endif
 
+/*
+ * An ADF4351 register set worked out for one channel, the tuned frequency
+ * rounded to the Hz.  Entries from a channel plan are pinned; the rest are
+ * replaced in turn once the cache fills.
+ */
+#define WHITEBOX_SYNTH_CACHE_SIZE 64
+
+typedef struct whitebox_synth {
+    uint32_t channel;
+    int pinned;
+    uint32_t adf4351[WA_REGS_COUNT];
+} whitebox_synth_t;
+
 struct whitebox {
     int fd;
     cmx991_t cmx991;
@@ -26,6 +40,23 @@ struct whitebox {
 
     void *user_buffer;
     unsigned long user_buffer_size;
+
+    // The exciter, receiver and FIR settings only this library changes, as
+    // last written, so setters needn't read them back and getters needn't
+    // ask the driver.  Fields changed since the last W_COMMIT are flagged
+    // in shadow.dirty.  Loaded at open and reset.
+    whitebox_commit_t shadow;
+    int fir_loaded;
+    int transaction;
+
+    whitebox_synth_t synth[WHITEBOX_SYNTH_CACHE_SIZE];
+    int synth_count;
+    int synth_next;
+    // The ADF4351 registers as last written, so a retune to the channel
+    // we're on costs nothing.  Loaded at reset.
+    uint32_t adf4351_regs[WA_REGS_COUNT];
+    // Whether the driver has W_PARAM_GET and W_PARAM_SET.  Probed at open.
+    int param_ioctl;
 };
 
 typedef struct whitebox whitebox_t;
@@ -34,12 +65,30 @@ long whitebox_tx_bytes_total();
 int whitebox_parameter_set(const char *param, int value);
 int whitebox_parameter_get(const char *param);
 
+/*
+ * The WP_* tunables, through an ioctl on the open device rather than
+ * sysfs.  A driver without the ioctl falls back to the sysfs file.  They
+ * return -1 with errno set on error: EINVAL for an unknown id, ERANGE for
+ * a value the driver won't take.
+ */
+int whitebox_param_set(whitebox_t* wb, int id, int value);
+int whitebox_param_get(whitebox_t* wb, int id);
+
 void whitebox_init(whitebox_t* wb);
 whitebox_t* whitebox_alloc(void);
 void whitebox_free(whitebox_t* wb);
 int whitebox_open(whitebox_t* wb, const char* filn, int flags, int rate);
 int whitebox_mmap(whitebox_t* wb);
 int whitebox_munmap(whitebox_t* wb);
+
+/*
+ * Once the device is mapped, samples are written or read in place at the
+ * address W_MMAP_WRITE or W_MMAP_READ gave, and then bytes of them are
+ * handed to the driver, or back to it, with these.  They return bytes, or
+ * -1 with errno set.
+ */
+ssize_t whitebox_tx_commit(whitebox_t* wb, size_t bytes);
+ssize_t whitebox_rx_commit(whitebox_t* wb, size_t bytes);
 int whitebox_fd(whitebox_t* wb);
 int whitebox_close(whitebox_t* wb);
 void whitebox_debug_to_file(whitebox_t* wb, FILE* f);
@@ -47,6 +96,35 @@ int whitebox_reset(whitebox_t* wb);
 unsigned int whitebox_status(whitebox_t* wb);
 int whitebox_plls_locked(whitebox_t* wb);
 
+/*
+ * Waits up to timeout_us for both PLLs to lock, sleeping in the driver
+ * rather than spinning.  Returns 1 once locked, 0 on timeout and -1 on
+ * error.  How long it took, in microseconds, goes in lock_us if that's
+ * not NULL.  whitebox_plls_locked() waits WHITEBOX_LOCK_TIMEOUT_US.
+ */
+#define WHITEBOX_LOCK_TIMEOUT_US 5000
+int whitebox_plls_wait_locked(whitebox_t* wb, unsigned timeout_us,
+        unsigned* lock_us);
+
+/*
+ * Setters called between begin and commit change only the shadow, and
+ * commit writes whatever changed in a single ioctl.  Outside a
+ * transaction each setter commits its own change.  Transactions nest;
+ * only the outermost commit writes.  Flag disables and clears still go
+ * straight to the driver.
+ */
+void whitebox_begin(whitebox_t* wb);
+int whitebox_commit(whitebox_t* wb);
+
+/*
+ * Works out the synthesizer registers for each frequency up front, so
+ * tuning to any of them is a table lookup.  May be called before or after
+ * open, and again to add channels.  Returns -ENOSPC once the cache is
+ * full of planned channels.
+ */
+int whitebox_channel_plan(whitebox_t* wb, const float* frequencies, int count);
+void whitebox_channel_plan_clear(whitebox_t* wb);
+
 int whitebox_tx_clear(whitebox_t* wb);
 int whitebox_tx(whitebox_t* wb, float frequency);
 int whitebox_tx_fine_tune(whitebox_t* wb, float frequency);
@@ -58,6 +136,8 @@ void whitebox_tx_get_buffer_threshold(whitebox_t *wb, uint16_t *aeval, uint16_t
 int whitebox_tx_get_buffer_runs(whitebox_t* wb, uint16_t* overruns, uint16_t* underruns);
 int whitebox_tx_set_latency(whitebox_t *wb, int ms);
 int whitebox_tx_get_latency(whitebox_t *wb);
+// Bytes written to the transmit buffer that the exciter hasn't taken yet.
+long whitebox_tx_fill(whitebox_t *wb);
 
 int whitebox_tx_flags_enable(whitebox_t* wb, uint32_t flags);
 void whitebox_tx_flags_disable(whitebox_t* wb, uint32_t flags);
@@ -78,6 +158,37 @@ int whitebox_rx_standby(whitebox_t* wb);
 int whitebox_rx_cal_enable(whitebox_t *wb);
 int whitebox_rx_cal_disable(whitebox_t *wb);
 
+/*
+ * One row of a scan: the frequency to visit, and what was found there.
+ * rssi is the mean power over the dwell in dB below a full scale tone,
+ * -HUGE_VAL if the synthesizer didn't lock.  lock_us is how long it took
+ * to lock after the retune.
+ */
+typedef struct whitebox_scan_channel {
+    float frequency;
+    float rssi;
+    unsigned lock_us;
+    int locked;
+} whitebox_scan_channel_t;
+
+#define WHITEBOX_SCAN_TIMEOUT_MS 1000
+// How much is dropped after each lock, while the receive filters settle,
+// before the dwell starts.
+#define WHITEBOX_SCAN_SETTLE_US 1000
+
+/*
+ * Steps the receiver through count channels, integrating the power of
+ * dwell samples of I/Q on each, after dropping whatever was buffered and
+ * WHITEBOX_SCAN_SETTLE_US more.  Register sets for the channels are
+ * worked out up front, as far as the cache holds them, so a step is a
+ * synthesizer write followed by a wait for lock, and no longer.  The
+ * channel plan is left alone.  Needs the buffer mapped with whitebox_mmap().
+ * Leaves the receiver stopped.  Returns the channels scanned per second,
+ * or -1 on error.
+ */
+float whitebox_scan(whitebox_t* wb, whitebox_scan_channel_t* channels,
+        int count, unsigned long dwell);
+
 int whitebox_rx_set_decim(whitebox_t* wb, uint32_t decim);
 int whitebox_rx_set_latency(whitebox_t *wb, int ms);
 int whitebox_rx_get_latency(whitebox_t *wb);
@@ -88,6 +199,15 @@ void whitebox_rx_flags_disable(whitebox_t* wb, uint32_t flags);
 void whitebox_rx_set_correction(whitebox_t *wb, int16_t correct_i, int16_t correct_q);
 void whitebox_rx_get_correction(whitebox_t *wb, int16_t *correct_i, int16_t *correct_q);
 
+/*
+ * Loads N coefficients, at most WHITEBOX_FIR_MAX_COEFFS, into bank 0-3.
+ * Getting them back only works for the bank in use; any other fails with
+ * errno EINVAL.
+ */
+#define WHITEBOX_FIR_MAX_COEFFS (WF_COEFF_COUNT - 1)
+int whitebox_fir_load_coeffs(whitebox_t *wb, int8_t bank, int N, int32_t *coeffs);
+int whitebox_fir_get_coeffs(whitebox_t *wb, int8_t bank, int N, int32_t *coeffs);
+
 uint16_t whitebox_cic_shift(uint16_t interp);
 
 #ifdef __cplusplus
@@ -7,7 +7,7 @@
 typedef int (*whitebox_test_func_t)(void *data);
 
 typedef struct whitebox_test {
-    char *name;
+    const char *name;
     whitebox_test_func_t func;
     void *data;
 } whitebox_test_t;
@@ -730,6 +730,9 @@ function responseArrayBuffer(data) {
   case 1:
     responseReceiveAudio(data);
     break;
+  case 2:
+    responseSpectrum(data);
+    break;
   default:
     notice("Received unknown data type " + inTypeView[0]);
   }
@@ -764,6 +767,33 @@ function responseReceiveAudio(data)
     context);
 }
 
+// Spectrum frame: uint32 sample rate, then one byte per bin in 0.5 dB
+// steps from -127.5 dBFS, most negative frequency first. Each frame is
+// drawn as a new top row of the waterfall, scrolling older rows down.
+function responseSpectrum(data)
+{
+  var canvas = document.getElementById('waterfall');
+
+  if (!canvas) {
+    return;
+  }
+
+  var bins = new Uint8Array(data, 8);
+  var context = canvas.getContext('2d');
+  var width = canvas.width;
+  var row = context.createImageData(width, 1);
+
+  context.drawImage(canvas, 0, 0, width, canvas.height - 1, 0, 1, width, canvas.height - 1);
+  for (var x = 0; x < width; x++) {
+    var v = bins[Math.floor(x * bins.length / width)];
+    row.data[x * 4] = v;
+    row.data[x * 4 + 1] = v > 128 ? (v - 128) * 2 : 0;
+    row.data[x * 4 + 2] = 255 - v;
+    row.data[x * 4 + 3] = 255;
+  }
+  context.putImageData(row, 0, 0);
+}
+
 function responseString(data) {
   var r = window.radioclient;
   var root = JSON.parse(data);